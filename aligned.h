@@ -0,0 +1,32 @@
+#ifndef ALIGNED_H
+#define ALIGNED_H
+// Allocator for std::vector which hands out cacheline-aligned arrays.
+#include <cstdlib>
+#include <cstddef>
+#include <new>
+
+template <typename T, size_t ALIGN = 64>
+struct aligned_allocator {
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind { typedef aligned_allocator<U, ALIGN> other; };
+
+    aligned_allocator() { }
+    template <typename U>
+    aligned_allocator(const aligned_allocator<U, ALIGN> &) { }
+
+    T *allocate(size_t n) {
+        void *p;
+        if (posix_memalign(&p, ALIGN, n * sizeof(T)) != 0)
+            throw std::bad_alloc();
+        return (T *)p;
+    }
+    void deallocate(T *p, size_t) { free(p); }
+};
+
+template <typename T, typename U, size_t ALIGN>
+bool operator ==(const aligned_allocator<T, ALIGN> &, const aligned_allocator<U, ALIGN> &) { return true; }
+template <typename T, typename U, size_t ALIGN>
+bool operator !=(const aligned_allocator<T, ALIGN> &, const aligned_allocator<U, ALIGN> &) { return false; }
+#endif // ALIGNED_H
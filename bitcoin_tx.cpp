@@ -11,6 +11,7 @@ extern "C" {
 #include <cstring>
 #include <stdexcept>
 #include <algorithm>
+#include <utility>
 
 void add_varint(varint_t v,
 				void (*add)(const void *, size_t, void *), void *addp)
@@ -89,122 +90,191 @@ void bitcoin_tx::add_tx(void (*add)(const void *, size_t, void *), void *addp) c
 	add_le32(lock_time, add, addp);
 }
 
-/* Sets *cursor to NULL and returns NULL when a pull fails. */
-static const u8 *pull(const u8 **cursor, size_t *max, void *copy, size_t n)
-{
-	const u8 *p = *cursor;
+/* Where we parse from: pull() copies the next n bytes, of max left.
+ * Once a pull fails, ok is false and every later pull gives zeroes. */
+struct pull_state {
+	bool (*pull)(void *copy, size_t n, void *pullp);
+	void *pullp;
+	size_t max;
+	bool ok;
+};
 
-	if (*max < n) {
-		*cursor = NULL;
-		*max = 0;
+static bool pull(struct pull_state *ps, void *copy, size_t n)
+{
+	if (!ps->ok || ps->max < n || !ps->pull(copy, n, ps->pullp)) {
+		ps->ok = false;
+		ps->max = 0;
 		/* Just make sure we don't leak uninitialized mem! */
-		if (copy)
-			memset(copy, 0, n);
-		return NULL;
+		memset(copy, 0, n);
+		return false;
 	}
+	ps->max -= n;
+	return true;
+}
+
+static bool pull_cursor(void *copy, size_t n, void *pcursor)
+{
+	const u8 **cursor = (const u8 **)pcursor;
+
+	memcpy(copy, *cursor, n);
 	*cursor += n;
-	*max -= n;
-	if (copy)
-		memcpy(copy, p, n);
-	return p;
+	return true;
 }
 
-u64 pull_varint(const u8 **cursor, size_t *max)
+static u64 pull_varint(struct pull_state *ps)
 {
-	u64 ret;
-	const u8 *p;
+	u8 p[8];
 
-	p = pull(cursor, max, NULL, 1);
-	if (!p)
+	if (!pull(ps, p, 1))
 		return 0;
 
-	if (*p < 0xfd) {
-		ret = *p;
-	} else if (*p == 0xfd) {
-		p = pull(cursor, max, NULL, 2);
-		if (!p)
+	if (p[0] < 0xfd) {
+		return p[0];
+	} else if (p[0] == 0xfd) {
+		if (!pull(ps, p, 2))
 			return 0;
-		ret = ((u64)p[1] << 8) + p[0];
-	} else if (*p == 0xfe) {
-		p = pull(cursor, max, NULL, 4);
-		if (!p)
+		return ((u64)p[1] << 8) + p[0];
+	} else if (p[0] == 0xfe) {
+		if (!pull(ps, p, 4))
 			return 0;
-		ret = ((u64)p[3] << 24) + ((u64)p[2] << 16)
+		return ((u64)p[3] << 24) + ((u64)p[2] << 16)
 			+ ((u64)p[1] << 8) + p[0];
 	} else {
-		p = pull(cursor, max, NULL, 8);
-		if (!p)
+		if (!pull(ps, p, 8))
 			return 0;
-		ret = ((u64)p[7] << 56) + ((u64)p[6] << 48)
+		return ((u64)p[7] << 56) + ((u64)p[6] << 48)
 			+ ((u64)p[5] << 40) + ((u64)p[4] << 32)
 			+ ((u64)p[3] << 24) + ((u64)p[2] << 16)
 			+ ((u64)p[1] << 8) + p[0];
 	}
+}
+
+/* Sets *cursor to NULL when a pull fails. */
+u64 pull_varint(const u8 **cursor, size_t *max)
+{
+	struct pull_state ps = { pull_cursor, cursor, *max, true };
+	u64 ret = pull_varint(&ps);
+
+	if (!ps.ok)
+		*cursor = NULL;
+	*max = ps.max;
 	return ret;
 }
 
-static u32 pull_le32(const u8 **cursor, size_t *max)
+static u32 pull_le32(struct pull_state *ps)
 {
 	le32 ret;
 
-	if (!pull(cursor, max, &ret, sizeof(ret)))
+	if (!pull(ps, &ret, sizeof(ret)))
 		return 0;
 	return le32_to_cpu(ret);
 }
 
-static u64 pull_le64(const u8 **cursor, size_t *max)
+static u64 pull_le64(struct pull_state *ps)
 {
 	le64 ret;
 
-	if (!pull(cursor, max, &ret, sizeof(ret)))
+	if (!pull(ps, &ret, sizeof(ret)))
 		return 0;
 	return le64_to_cpu(ret);
 }
 
-static bool pull_sha256_double(const u8 **cursor, size_t *max,
-			       struct sha256_double *h)
+static bool pull_sha256_double(struct pull_state *ps, struct sha256_double *h)
+{
+	return pull(ps, h, sizeof(*h));
+}
+
+/* Garbage can claim any length: never allocate more than is left. */
+static u8 *pull_script(struct pull_state *ps, varint_t *len)
 {
-	return pull(cursor, max, h, sizeof(*h));
+	u8 *script;
+
+	*len = pull_varint(ps);
+	if (*len > ps->max) {
+		ps->ok = false;
+		ps->max = 0;
+		*len = 0;
+	}
+	script = new u8[*len];
+	pull(ps, script, *len);
+	return script;
 }
 
-static void pull_input(const u8 **cursor, size_t *max,
-					   struct bitcoin_tx_input *input)
+static void pull_input(struct pull_state *ps, struct bitcoin_tx_input *input)
 {
-	pull_sha256_double(cursor, max, &input->txid.shad);
-	input->index = pull_le32(cursor, max);
-	input->script_length = pull_varint(cursor, max);
-	input->script = new u8[input->script_length];
-	pull(cursor, max, input->script, input->script_length);
-	input->sequence_number = pull_le32(cursor, max);
+	pull_sha256_double(ps, &input->txid.shad);
+	input->index = pull_le32(ps);
+	input->script = pull_script(ps, &input->script_length);
+	input->sequence_number = pull_le32(ps);
 }
 
-static void pull_output(const u8 **cursor, size_t *max,
-						struct bitcoin_tx_output *output)
+static void pull_output(struct pull_state *ps, struct bitcoin_tx_output *output)
 {
-	output->amount = pull_le64(cursor, max);
-	output->script_length = pull_varint(cursor, max);
-	output->script = new u8[output->script_length];
-	pull(cursor, max, output->script, output->script_length);
+	output->amount = pull_le64(ps);
+	output->script = pull_script(ps, &output->script_length);
 }
 
-static bool pull_bitcoin_tx(bitcoin_tx *tx,
-							const u8 **cursor, size_t *max)
+/* Smallest they can be: an empty script is still a 1-byte length. */
+#define MIN_INPUT_LEN (sizeof(struct sha256_double) + 4 + 1 + 4)
+#define MIN_OUTPUT_LEN (8 + 1)
+
+static bool pull_bitcoin_tx(bitcoin_tx *tx, struct pull_state *ps)
 {
 	size_t i;
 
-	tx->version = pull_le32(cursor, max);
-	tx->input_count = pull_varint(cursor, max);
+	tx->version = pull_le32(ps);
+	tx->input_count = pull_varint(ps);
+	if (tx->input_count > ps->max / MIN_INPUT_LEN)
+		tx->input_count = 0, ps->ok = false;
 	tx->input = new bitcoin_tx_input[tx->input_count];
 	for (i = 0; i < tx->input_count; i++)
-		pull_input(cursor, max, tx->input + i);
-	tx->output_count = pull_varint(cursor, max);
+		pull_input(ps, tx->input + i);
+	tx->output_count = pull_varint(ps);
+	if (tx->output_count > ps->max / MIN_OUTPUT_LEN)
+		tx->output_count = 0, ps->ok = false;
 	tx->output = new bitcoin_tx_output[tx->output_count];
 	for (i = 0; i < tx->output_count; i++)
-		pull_output(cursor, max, tx->output + i);
-	tx->lock_time = pull_le32(cursor, max);
+		pull_output(ps, tx->output + i);
+	tx->lock_time = pull_le32(ps);
 
 	/* If we ran short, fail. */
-	return (*cursor);
+	return ps->ok;
+}
+
+static bool pull_bitcoin_tx(bitcoin_tx *tx, const u8 **cursor, size_t *max)
+{
+	struct pull_state ps = { pull_cursor, cursor, *max, true };
+	bool ok = pull_bitcoin_tx(tx, &ps);
+
+	if (!ok)
+		*cursor = NULL;
+	*max = ps.max;
+	return ok;
+}
+
+bool bitcoin_tx::pull_tx(bool (*pull)(void *, size_t, void *), void *pullp,
+						 size_t max)
+{
+	struct pull_state ps = { pull, pullp, max, true };
+	bitcoin_tx tx;
+
+	if (!pull_bitcoin_tx(&tx, &ps)) {
+		tx.release();
+		return false;
+	}
+	// tx gets our old arrays, to free.
+	std::swap(*this, tx);
+	tx.release();
+	return true;
+}
+
+void bitcoin_tx::release()
+{
+	delete[] input;
+	delete[] output;
+	input = NULL;
+	output = NULL;
+	input_count = output_count = 0;
 }
 
 static void add_sha(const void *data, size_t len, void *shactx_)
@@ -77,6 +77,9 @@ struct bitcoin_tx {
     struct bitcoin_tx_output *output;
     u32 lock_time;
 
+    // Empty, with nothing allocated yet.
+    bitcoin_tx() : version(1), input_count(0), input(NULL), output_count(0),
+                   output(NULL), lock_time(0xFFFFFFFF) { }
     bitcoin_tx(varint_t input_count, varint_t output_count);
     bitcoin_tx(const u8 **p, size_t *len);
     bitcoin_tx(const char *filename);
@@ -87,6 +90,15 @@ struct bitcoin_tx {
 
     // Generic accumulate function.
     void add_tx(void (*add)(const void *, size_t, void *), void *addp) const;
+
+    // And the reverse: parse from pull(copy, n, pullp), with max bytes
+    // there in all.  False if they're not a tx (*this is untouched);
+    // doesn't throw, and won't allocate more than max says is there.
+    bool pull_tx(bool (*pull)(void *, size_t, void *), void *pullp, size_t max);
+
+    // We're plain old data, so copies share input and output: whoever
+    // owns them last calls this.
+    void release();
 };
 
 // To place them in unordered_set
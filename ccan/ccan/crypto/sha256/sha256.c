@@ -47,7 +47,26 @@ void sha256_done(struct sha256_ctx *ctx, struct sha256 *res)
 	SHA256_Final(res->u.u8, &ctx->c);
 	invalidate_sha256(ctx);
 }
+
+const char *sha256_impl(void)
+{
+	return "openssl";
+}
+
+const char *sha256_selftest(size_t blocks)
+{
+	return NULL;
+}
+#else
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_X86_TRANSFORMS 1
+/* So each target() below gets its own copy of the rounds. */
+#define TRANSFORM_INLINE inline __attribute__((always_inline))
 #else
+#define TRANSFORM_INLINE inline
+#endif
+
 static uint32_t Ch(uint32_t x, uint32_t y, uint32_t z)
 {
 	return z ^ (x & (y ^ z));
@@ -83,7 +102,7 @@ static void Round(uint32_t a, uint32_t b, uint32_t c, uint32_t *d, uint32_t e, u
 }
 
 /** Perform one SHA-256 transformation, processing a 64-byte chunk. */
-static void Transform(uint32_t *s, const uint32_t *chunk)
+static TRANSFORM_INLINE void TransformRounds(uint32_t *s, const uint32_t *chunk)
 {
 	uint32_t a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
 	uint32_t w0, w1, w2, w3, w4, w5, w6, w7, w8, w9, w10, w11, w12, w13, w14, w15;
@@ -166,6 +185,225 @@ static void Transform(uint32_t *s, const uint32_t *chunk)
 	s[7] += h;
 }
 
+static void TransformPortable(uint32_t *s, const uint32_t *chunk)
+{
+	TransformRounds(s, chunk);
+}
+
+#ifdef HAVE_X86_TRANSFORMS
+/* Just the portable rounds, compiled with BMI2 (rorx, andn) allowed. */
+__attribute__((target("bmi2")))
+static void TransformBMI2(uint32_t *s, const uint32_t *chunk)
+{
+	TransformRounds(s, chunk);
+}
+
+static const uint32_t K[64] __attribute__((aligned(16))) = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/** The same, with the x86 SHA extensions: 4 rounds per step. */
+__attribute__((target("sha,sse4.1")))
+static void TransformSHANI(uint32_t *s, const uint32_t *chunk)
+{
+	const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+					     0x0405060700010203ULL);
+	__m128i state0, state1, abef, cdgh, tmp, msg;
+	__m128i w0, w1, w2, w3, w;
+	int i;
+
+	/* The instructions want the state as ABEF and CDGH. */
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&s[0]), 0xB1);
+	state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&s[4]), 0x1B);
+	state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+	abef = state0;
+	cdgh = state1;
+
+	/* w0-w3 are the last four groups of 4 message words. */
+	w0 = w1 = w2 = w3 = _mm_setzero_si128();
+	for (i = 0; i < 16; i++) {
+		if (i < 4)
+			w = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(chunk + i * 4)), bswap);
+		else {
+			w = _mm_sha256msg1_epu32(w0, w1);
+			w = _mm_add_epi32(w, _mm_alignr_epi8(w3, w2, 4));
+			w = _mm_sha256msg2_epu32(w, w3);
+		}
+		w0 = w1;
+		w1 = w2;
+		w2 = w3;
+		w3 = w;
+
+		msg = _mm_add_epi32(w, _mm_load_si128((const __m128i *)&K[i * 4]));
+		state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+		msg = _mm_shuffle_epi32(msg, 0x0E);
+		state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+	}
+
+	state0 = _mm_add_epi32(state0, abef);
+	state1 = _mm_add_epi32(state1, cdgh);
+
+	/* And back to ABCD and EFGH. */
+	tmp = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+	state1 = _mm_alignr_epi8(state1, tmp, 8);
+	_mm_storeu_si128((__m128i *)&s[0], state0);
+	_mm_storeu_si128((__m128i *)&s[4], state1);
+}
+#endif /* HAVE_X86_TRANSFORMS */
+
+/* Picked at startup; until then (or if nothing better), the portable one. */
+static void (*Transform)(uint32_t *s, const uint32_t *chunk) = TransformPortable;
+
+#ifdef HAVE_X86_TRANSFORMS
+static bool have_shani(void)
+{
+	return __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+}
+
+static bool have_bmi2(void)
+{
+	return __builtin_cpu_supports("bmi2");
+}
+#endif
+
+/* Every transform, best first, and whether this CPU can run it. */
+static const struct {
+	const char *name;
+	void (*fn)(uint32_t *s, const uint32_t *chunk);
+	bool (*usable)(void);
+} transforms[] = {
+#ifdef HAVE_X86_TRANSFORMS
+	{ "shani", TransformSHANI, have_shani },
+	{ "bmi2", TransformBMI2, have_bmi2 },
+#endif
+	{ "portable", TransformPortable, NULL }
+};
+#define NUM_TRANSFORMS (sizeof(transforms) / sizeof(transforms[0]))
+
+static bool transform_usable(size_t i)
+{
+	return !transforms[i].usable || transforms[i].usable();
+}
+
+/* Known answers from FIPS 180-2: "abc" is one block, the other two. */
+static bool transform_ok(void (*transform)(uint32_t *, const uint32_t *))
+{
+	static const char *msg[] = {
+		"abc",
+		"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"
+	};
+	static const uint32_t answer[][8] = {
+		{ 0xba7816bf, 0x8f01cfea, 0x414140de, 0x5dae2223,
+		  0xb00361a3, 0x96177a9c, 0xb410ff61, 0xf20015ad },
+		{ 0x248d6a61, 0xd20638b8, 0xe5c02693, 0x0c3e6039,
+		  0xa33ce459, 0x64ff2167, 0xf6ecedd4, 0x19db06c1 }
+	};
+	size_t i, b;
+
+	for (i = 0; i < sizeof(msg) / sizeof(msg[0]); i++) {
+		struct sha256_ctx ctx = SHA256_INIT;
+		union {
+			unsigned char u8[128];
+			uint32_t u32[32];
+		} buf;
+		size_t len = strlen(msg[i]);
+		size_t blocks = (len + 1 + 8 + 63) / 64;
+		uint64_t bits = cpu_to_be64((uint64_t)len << 3);
+
+		memset(buf.u8, 0, sizeof(buf));
+		memcpy(buf.u8, msg[i], len);
+		buf.u8[len] = 0x80;
+		memcpy(buf.u8 + blocks * 64 - 8, &bits, 8);
+		for (b = 0; b < blocks; b++)
+			transform(ctx.s, buf.u32 + b * 16);
+		if (memcmp(ctx.s, answer[i], sizeof(ctx.s)) != 0)
+			return false;
+	}
+	return true;
+}
+
+#ifdef HAVE_X86_TRANSFORMS
+__attribute__((constructor))
+static void pick_transform(void)
+{
+	size_t i;
+
+	__builtin_cpu_init();
+	for (i = 0; i < NUM_TRANSFORMS; i++) {
+		if (transform_usable(i) && transform_ok(transforms[i].fn)) {
+			Transform = transforms[i].fn;
+			break;
+		}
+	}
+}
+#endif /* HAVE_X86_TRANSFORMS */
+
+const char *sha256_impl(void)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_TRANSFORMS; i++)
+		if (transforms[i].fn == Transform)
+			break;
+	return transforms[i].name;
+}
+
+/* xorshift64: plenty for noise to feed the transforms. */
+static uint32_t noise(uint64_t *x)
+{
+	*x ^= *x << 13;
+	*x ^= *x >> 7;
+	*x ^= *x << 17;
+	return *x >> 32;
+}
+
+const char *sha256_selftest(size_t blocks)
+{
+	uint32_t start[8], want[8], got[8], chunk[16];
+	uint64_t x = 0x6a09e667f3bcc908ULL;
+	size_t i, b, j;
+
+	for (i = 0; i < NUM_TRANSFORMS; i++)
+		if (transform_usable(i) && !transform_ok(transforms[i].fn))
+			return transforms[i].name;
+
+	for (b = 0; b < blocks; b++) {
+		for (j = 0; j < 8; j++)
+			start[j] = noise(&x);
+		for (j = 0; j < 16; j++)
+			chunk[j] = noise(&x);
+		memcpy(want, start, sizeof(want));
+		TransformPortable(want, chunk);
+		for (i = 0; i < NUM_TRANSFORMS; i++) {
+			if (!transform_usable(i))
+				continue;
+			memcpy(got, start, sizeof(got));
+			transforms[i].fn(got, chunk);
+			if (memcmp(got, want, sizeof(got)) != 0)
+				return transforms[i].name;
+		}
+	}
+	return NULL;
+}
+
 static bool alignment_ok(const void *p, size_t n)
 {
 #if HAVE_UNALIGNED_ACCESS
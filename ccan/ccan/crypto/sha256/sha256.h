@@ -145,4 +145,22 @@ void sha256_le64(struct sha256_ctx *ctx, uint64_t v);
 void sha256_be16(struct sha256_ctx *ctx, uint16_t v);
 void sha256_be32(struct sha256_ctx *ctx, uint32_t v);
 void sha256_be64(struct sha256_ctx *ctx, uint64_t v);
+
+/**
+ * sha256_impl - which block transform sha256 is using
+ *
+ * "openssl", "portable", or on x86 "shani" or "bmi2": the first the CPU
+ * runs which gets the FIPS 180-2 answers right, picked at startup.
+ */
+const char *sha256_impl(void);
+
+/**
+ * sha256_selftest - check every block transform this CPU runs
+ * @blocks: how many pseudo-random blocks to try them on
+ *
+ * Each must get the FIPS 180-2 answers, then agree with the portable
+ * one on @blocks random blocks and states.  Returns NULL if they do,
+ * otherwise the sha256_impl() name of the first which didn't.
+ */
+const char *sha256_selftest(size_t blocks);
 #endif /* CCAN_CRYPTO_SHA256_H */
@@ -0,0 +1,429 @@
+// Benchmark IBLT construction and peeling on synthetic transactions.
+// It produces output as:
+// mode,threads,txs,slices,insert-ns-per-slice,diffslices,buckets,peel-ns-per-slice,decode-allocs,tx-allocs,success
+// where threads 0 is the serial next() loop, otherwise iblt::peel(),
+// decode-allocs is the allocations in the last run's decode (building our
+// IBLT, differencing and peeling) with a decode_context reused each run,
+// and tx-allocs is how many of those hold the txs it recovered (each
+// one's inputs, outputs and scripts): the rest should be about 0.
+//
+// With --txid48, it checks every txid48_batch() kernel this CPU runs
+// against txid48() (failing if any differ), then times hashing the txs'
+// txid48s instead:
+// impl,txids,txids-per-sec
+// one at a time ("scalar"), then with txid48_batch().
+//
+// With --murmur, it checks every MurmurHash3_seeds() kernel this CPU
+// runs against MurmurHash3() for every length up to a slice (failing if
+// any differ), then times hashing the txs' slices as rawiblt does:
+// impl,slices,slices-per-sec
+// one seed at a time ("scalar"), then with MurmurHash3_seeds().
+//
+// With --sha256, it checks every SHA-256 block transform this CPU runs
+// against the portable one (failing if any disagree), then times the
+// one picked:
+// impl,blocks,blocks-per-sec
+//
+// With --xor, it checks every xor_bytes()/bytes_zero() kernel this CPU
+// runs against the scalar one, at odd lengths and alignments (failing if
+// any differ), then times XORing one table of buckets into another:
+// impl,buckets,buckets-per-sec
+extern "C" {
+#include <ccan/err/err.h>
+#include <ccan/crypto/sha256/sha256.h>
+}
+#include "iblt.h"
+#include "rawiblt.h"
+#include "tx.h"
+#include "murmur.h"
+#include "xorbytes.h"
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <iostream>
+#include <thread>
+
+// Count every allocation, to see what decoding does.
+static std::atomic<size_t> num_allocs;
+
+void *operator new(size_t size)
+{
+	num_allocs++;
+	void *p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+static double elapsed_ns(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Roughly the shape of a 1-3 input, 1-3 output P2PKH tx.
+static tx *random_tx(std::mt19937_64 &rng)
+{
+	bitcoin_tx *btx = new bitcoin_tx(1 + rng() % 3, 1 + rng() % 3);
+
+	for (varint_t i = 0; i < btx->input_count; i++) {
+		bitcoin_tx_input *in = &btx->input[i];
+		for (size_t j = 0; j < sizeof(in->txid.shad.sha.u.u8); j++)
+			in->txid.shad.sha.u.u8[j] = rng();
+		in->index = rng() % 4;
+		in->script_length = 106 + rng() % 4;
+		in->script = new u8[in->script_length];
+		for (size_t j = 0; j < in->script_length; j++)
+			in->script[j] = rng();
+	}
+	for (varint_t i = 0; i < btx->output_count; i++) {
+		bitcoin_tx_output *out = &btx->output[i];
+		out->amount = rng() % 100000000;
+		out->script_length = 25;
+		out->script = new u8[out->script_length];
+		for (size_t j = 0; j < out->script_length; j++)
+			out->script[j] = rng();
+	}
+	return new tx(rng() % 100000, btx);
+}
+
+static size_t count_slices(const txmap &txs)
+{
+	size_t slices = 0;
+
+	for (const auto &t: txs)
+		slices += slice_tx(*t.second, txid48(1, t.first)).size();
+	return slices;
+}
+
+// Peel until stuck; returns true if it emptied.  nthreads 0 means the
+// serial next() loop, otherwise iblt::peel() with that many threads.
+// Adds the allocations holding the txs we recover to *tx_allocs.
+static bool peel(decode_context &ctx, iblt &diff, u64 seed,
+				 unsigned int nthreads, size_t *tx_allocs)
+{
+	iblt::bucket_type t;
+	txslice s;
+	// As iblt-decode: a bogus slice seen twice fails, rather than
+	// going round forever.
+	tx_assembler &theirs = ctx.assembler;
+	theirs.reset(seed, [tx_allocs](const txid48 &, const bitcoin_tx &btx) {
+			*tx_allocs += 2 + btx.input_count + btx.output_count;
+		});
+
+	if (nthreads) {
+		// On failure, peel() puts diff back itself.
+		theirs.checkpoint();
+		ctx.peeled_ours.clear();
+		auto lookup = [&ctx](const txid48 &id) { return ctx.our_tx(id); };
+		if (diff.peel(ctx.workers, nthreads, lookup, &theirs, &ctx.peeled_ours)) {
+			for (const auto &id: ctx.peeled_ours)
+				ctx.remove_our_tx(id);
+		} else
+			theirs.rollback();
+	}
+
+	while ((t = diff.next(s)) != iblt::NEITHER) {
+		if (t == iblt::OURS) {
+			const tx *ours = ctx.our_tx(s.get_txid48());
+			if (!ours)
+				return false;
+			diff.remove_our_tx(*ours, s.get_txid48());
+			ctx.remove_our_tx(s.get_txid48());
+		} else {
+			if (!theirs.add(s))
+				return false;
+			diff.remove_their_slice(s);
+		}
+	}
+	return diff.empty();
+}
+
+// Every tx's txid48, one at a time and batched: they'd better agree.
+static void bench_txid48(const txmap &txs, unsigned int runs)
+{
+	const u64 seed = 0x1b1e7;
+	std::vector<const bitcoin_txid *> txids;
+	for (const auto &t: txs)
+		txids.push_back(&t.first);
+	std::vector<u64> one(txids.size()), batch(txids.size());
+	double one_ns = 0, batch_ns = 0;
+
+	const char *bad = txid48_batch_selftest(seed, txids.data(), txids.size());
+	if (bad)
+		errx(1, "txid48_batch kernel %s gets it wrong", bad);
+
+	for (unsigned int i = 0; i < runs; i++) {
+		auto start = std::chrono::steady_clock::now();
+		for (size_t j = 0; j < txids.size(); j++)
+			one[j] = txid48(seed + i, *txids[j]).get_id();
+		one_ns += elapsed_ns(start);
+
+		start = std::chrono::steady_clock::now();
+		txid48_batch(seed + i, txids.data(), txids.size(), batch.data());
+		batch_ns += elapsed_ns(start);
+
+		if (one != batch)
+			errx(1, "txid48_batch (%s) differs with seed %llu",
+				 txid48_batch_impl(), (unsigned long long)(seed + i));
+	}
+
+	std::cout << "scalar," << txids.size() << ","
+			  << txids.size() * runs / one_ns * 1e9 << std::endl;
+	std::cout << txid48_batch_impl() << "," << txids.size() << ","
+			  << txids.size() * runs / batch_ns * 1e9 << std::endl;
+}
+
+// Every seed the slow way and all at once: they'd better agree.
+static void bench_murmur(const txmap &txs, unsigned int runs)
+{
+	const size_t nh = raw_iblt::NUM_HASHES;
+	std::vector<txslice> slices;
+	for (const auto &t: txs)
+		slice_tx(*t.second, txid48(0x1b1e7, t.first), &slices);
+
+	// Every kernel, each tail length, and more seeds than any has lanes.
+	const char *bad = murmur_seeds_selftest(slices[0].as_bytes(),
+											 txslice::size(), 17);
+	if (bad)
+		errx(1, "MurmurHash3_seeds kernel %s gets it wrong", bad);
+
+	std::vector<u32> one(slices.size() * nh), seeds(slices.size() * nh);
+	double one_ns = 0, seeds_ns = 0;
+
+	for (unsigned int i = 0; i < runs; i++) {
+		auto start = std::chrono::steady_clock::now();
+		for (size_t j = 0; j < slices.size(); j++) {
+			for (size_t h = 0; h < nh; h++)
+				one[j * nh + h] = MurmurHash3(h, slices[j].as_bytes(),
+											  slices[j].size());
+		}
+		one_ns += elapsed_ns(start);
+
+		start = std::chrono::steady_clock::now();
+		for (size_t j = 0; j < slices.size(); j++)
+			MurmurHash3_seeds(&seeds[j * nh], nh, slices[j].as_bytes(),
+							  slices[j].size());
+		seeds_ns += elapsed_ns(start);
+
+		if (one != seeds)
+			errx(1, "MurmurHash3_seeds (%s) differs on slices",
+				 murmur_seeds_impl());
+	}
+
+	std::cout << "scalar," << slices.size() << ","
+			  << slices.size() * runs / one_ns * 1e9 << std::endl;
+	std::cout << murmur_seeds_impl() << "," << slices.size() << ","
+			  << slices.size() * runs / seeds_ns * 1e9 << std::endl;
+}
+
+// Every transform must agree before we time sha256() on 1MB of noise.
+static void bench_sha256(unsigned int runs)
+{
+	const char *bad = sha256_selftest(runs * 10000);
+	if (bad)
+		errx(1, "sha256 transform %s gets it wrong", bad);
+
+	std::mt19937_64 rng(352720);
+	std::vector<u64> buf(1000000 / sizeof(u64));
+	for (auto &v: buf)
+		v = rng();
+	struct sha256 sha;
+	double ns = 0;
+
+	for (unsigned int i = 0; i < runs; i++) {
+		auto start = std::chrono::steady_clock::now();
+		sha256(&sha, buf.data(), buf.size() * sizeof(u64));
+		ns += elapsed_ns(start);
+	}
+
+	size_t blocks = buf.size() * sizeof(u64) / 64;
+	std::cout << sha256_impl() << "," << blocks << ","
+			  << blocks * runs / ns * 1e9 << std::endl;
+}
+
+// Every kernel must agree before we time subtracting one table from another.
+static void bench_xor(size_t buckets, unsigned int runs)
+{
+	// A few of the widest kernel's blocks, and every tail.
+	const char *bad = xor_bytes_selftest(4 * 64 + 1);
+	if (bad)
+		errx(1, "xor_bytes kernel %s gets it wrong", bad);
+
+	if (!buckets)
+		buckets = 10000;
+	std::mt19937_64 rng(352720);
+	std::vector<u8> a(buckets * txslice::size()), b(a.size());
+	for (size_t i = 0; i < a.size(); i++) {
+		a[i] = rng();
+		b[i] = rng();
+	}
+	double ns = 0;
+
+	for (unsigned int i = 0; i < runs; i++) {
+		auto start = std::chrono::steady_clock::now();
+		for (size_t j = 0; j < buckets; j++)
+			xor_bytes(&a[j * txslice::size()], &b[j * txslice::size()],
+					  txslice::size());
+		ns += elapsed_ns(start);
+	}
+	// Don't let it optimize it all away.
+	if (bytes_zero(a.data(), a.size()))
+		errx(1, "xor_bytes zeroed everything?");
+
+	std::cout << xor_bytes_impl() << "," << buckets << ","
+			  << buckets * runs / ns * 1e9 << std::endl;
+}
+
+static void bench(const char *mode, unsigned int flags, unsigned int nthreads,
+				  const txmap &common, const txmap &theirs_only,
+				  const txmap &ours_only, size_t buckets, unsigned int runs)
+{
+	const u64 seed = 0x1b1e7;
+	txmap theirs(common), ours(common);
+	theirs.insert(theirs_only.begin(), theirs_only.end());
+	ours.insert(ours_only.begin(), ours_only.end());
+
+	size_t slices = count_slices(theirs);
+	size_t diffslices = count_slices(theirs_only) + count_slices(ours_only);
+	// Plenty, so peel time isn't dominated by failures.
+	if (!buckets)
+		buckets = diffslices * 2 + 10;
+	double insert_ns = 0, peel_ns = 0;
+	unsigned int successes = 0;
+	size_t allocs = 0, tx_allocs = 0;
+	decode_context ctx;
+
+	for (unsigned int i = 0; i < runs; i++) {
+		auto start = std::chrono::steady_clock::now();
+		raw_iblt their_riblt(buckets, seed + i, theirs, 1, flags);
+		insert_ns += elapsed_ns(start);
+
+		size_t before = num_allocs;
+		tx_allocs = 0;
+		iblt &diff = ctx.start(their_riblt, seed + i, ours);
+		start = std::chrono::steady_clock::now();
+		successes += peel(ctx, diff, seed + i, nthreads, &tx_allocs);
+		peel_ns += elapsed_ns(start);
+		allocs = num_allocs - before;
+	}
+
+	std::cout << mode << "," << nthreads << "," << theirs.size() << "," << slices
+			  << "," << insert_ns / runs / slices
+			  << "," << diffslices << "," << buckets
+			  << "," << peel_ns / runs / diffslices
+			  << "," << allocs - tx_allocs
+			  << "," << tx_allocs
+			  << "," << successes << "/" << runs
+			  << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int num_txs = 4000, num_diff = 100, runs = 10, max_threads = 0;
+	size_t buckets = 0;
+	bool txid48s = false, murmurs = false, sha256s = false, xors = false;
+
+	while (argv[1] && strncmp(argv[1], "--", 2) == 0) {
+		char *endp;
+		if (strncmp(argv[1], "--txs=", strlen("--txs=")) == 0) {
+			num_txs = strtoul(argv[1] + strlen("--txs="), &endp, 10);
+			if (*endp || !num_txs)
+				errx(1, "Invalid --txs");
+		} else if (strncmp(argv[1], "--diff=", strlen("--diff=")) == 0) {
+			num_diff = strtoul(argv[1] + strlen("--diff="), &endp, 10);
+			if (*endp || !num_diff)
+				errx(1, "Invalid --diff");
+		} else if (strncmp(argv[1], "--threads=", strlen("--threads=")) == 0) {
+			max_threads = strtoul(argv[1] + strlen("--threads="), &endp, 10);
+			if (*endp || !max_threads)
+				errx(1, "Invalid --threads");
+		} else if (strncmp(argv[1], "--runs=", strlen("--runs=")) == 0) {
+			runs = strtoul(argv[1] + strlen("--runs="), &endp, 10);
+			if (*endp || !runs)
+				errx(1, "Invalid --runs");
+		} else if (strncmp(argv[1], "--buckets=", strlen("--buckets=")) == 0) {
+			buckets = strtoul(argv[1] + strlen("--buckets="), &endp, 10);
+			if (*endp || !buckets)
+				errx(1, "Invalid --buckets");
+		} else if (strcmp(argv[1], "--txid48") == 0) {
+			txid48s = true;
+		} else if (strcmp(argv[1], "--murmur") == 0) {
+			murmurs = true;
+		} else if (strcmp(argv[1], "--sha256") == 0) {
+			sha256s = true;
+		} else if (strcmp(argv[1], "--xor") == 0) {
+			xors = true;
+		} else
+			errx(1, "Unknown argument %s", argv[1]);
+		argc--;
+		argv++;
+	}
+
+	if (argc != 1)
+		errx(1, "Usage: %s [--txs=<n>] [--diff=<n>] [--runs=<n>] [--threads=<n>] [--buckets=<n>] [--txid48] [--murmur] [--sha256] [--xor]", argv[0]);
+
+	if (sha256s) {
+		std::cout << "impl,blocks,blocks-per-sec" << std::endl;
+		bench_sha256(runs);
+		return 0;
+	}
+
+	if (xors) {
+		std::cout << "impl,buckets,buckets-per-sec" << std::endl;
+		bench_xor(buckets, runs);
+		return 0;
+	}
+
+	// Same txs every time, so modes are comparable.
+	std::mt19937_64 rng(352720);
+	txmap common, theirs_only, ours_only;
+	for (unsigned int i = 0; i < num_txs; i++) {
+		tx *t = random_tx(rng);
+		common.insert(std::make_pair(t->txid, t));
+	}
+	// Mostly they have txs we don't, but some the other way.
+	for (unsigned int i = 0; i < num_diff; i++) {
+		tx *t = random_tx(rng);
+		if (i % 4 == 3)
+			ours_only.insert(std::make_pair(t->txid, t));
+		else
+			theirs_only.insert(std::make_pair(t->txid, t));
+	}
+
+	if (murmurs) {
+		std::cout << "impl,slices,slices-per-sec" << std::endl;
+		bench_murmur(common, runs);
+		return 0;
+	}
+
+	if (txid48s) {
+		std::cout << "impl,txids,txids-per-sec" << std::endl;
+		bench_txid48(common, runs);
+		return 0;
+	}
+
+	// peel() won't use more threads than there are CPUs, so past that
+	// we'd just be timing the same thing again.
+	unsigned int cpus = std::thread::hardware_concurrency();
+	if (cpus && max_threads > cpus)
+		warnx("only %u CPUs: --threads=%u runs as %u", cpus, max_threads, cpus);
+
+	std::cout << "mode,threads,txs,slices,insert-ns-per-slice,diffslices,buckets,peel-ns-per-slice,decode-allocs,tx-allocs,success" << std::endl;
+	// Serial peel, then with --threads, parallel peel on 1 to n threads.
+	for (unsigned int t = 0; t <= max_threads; t++) {
+		bench("slice-hash", 0, t, common, theirs_only, ours_only, buckets, runs);
+		bench("key-hash", raw_iblt::KEY_HASH, t, common, theirs_only, ours_only, buckets, runs);
+		bench("subtables", raw_iblt::SUBTABLES, t, common, theirs_only, ours_only, buckets, runs);
+		bench("key-hash+subtables", raw_iblt::KEY_HASH|raw_iblt::SUBTABLES, t,
+			  common, theirs_only, ours_only, buckets, runs);
+		bench("key-hash+hash-check", raw_iblt::KEY_HASH|raw_iblt::HASH_CHECK, t,
+			  common, theirs_only, ours_only, buckets, runs);
+	}
+}
@@ -1,21 +1,31 @@
 // This code takes blocks, iblts and mempools and tries to decode them.
 // It produces output as:
 // blocknum,overhead,ibltbytes,peername,[0|1]
+// and with --diagnostics, why it stopped and what was left:
+// ...,reason,buckets_left=N singletons=N false_singletons=N bad_fragid=N stopping_set_estimate=N counts=c:n;c:n
+// where reason is ok, stuck (no singletons left), unknown-ours (a slice we
+// should have, but don't), dup-slice (theirs twice, or won't rebuild),
+// not-in-block (a recovered tx isn't in the block) or mismatch (emptied,
+// but that's not the block).
 
 extern "C" {
 #include <ccan/err/err.h>
 #include <ccan/str/hex/hex.h>
 }
 #include "txtree.h"
-#include "ibltpool.h"
+#include "wire_encode.h"
 #include "io.h"
 #include "rawiblt.h"
 #include "iblt.h"
 #include <stdexcept>
 #include <cassert>
 #include <algorithm>
+#include <memory>
 
-static raw_iblt *read_iblt(std::istream &in, size_t *ibltslices, u64 *seed)
+// Their IBLT stays in buf: we just point at it.
+static std::unique_ptr<raw_iblt_view> read_iblt(std::istream &in,
+												 std::vector<u8> *buf,
+												 size_t *ibltslices, u64 *seed)
 {
 	std::string ibltstr;
 
@@ -32,16 +42,17 @@ static raw_iblt *read_iblt(std::istream &in, size_t *ibltslices, u64 *seed)
 	if (!in)
 		throw std::runtime_error("Bad iblt hex line");
 
-	size_t ibltsize = hex_data_size(iblthex.size());
-	u8 data[ibltsize];
-	if (!hex_decode(iblthex.c_str(), iblthex.size(), data, sizeof(data)))
+	buf->resize(hex_data_size(iblthex.size()));
+	if (!hex_decode(iblthex.c_str(), iblthex.size(), buf->data(), buf->size()))
 		throw std::runtime_error("Bad iblt hex");
 
-	const u8 *p = data;
-	size_t len = sizeof(data);
-	*ibltslices = pull_varint(&p, &len);
-	if (!p)
+	const u8 *p = buf->data();
+	size_t len = buf->size();
+	unsigned int flags;
+	if (!pull_iblt_size(&p, &len, ibltslices, &flags))
 		throw std::runtime_error("Bad iblt size");
+	if (flags & ~raw_iblt::KNOWN_FLAGS)
+		throw std::runtime_error("Unknown iblt flags");
 
 	if (len < 16)
 		throw std::runtime_error("Bad iblt seed");
@@ -49,129 +60,223 @@ static raw_iblt *read_iblt(std::istream &in, size_t *ibltslices, u64 *seed)
 	p += 16;
 	len -= 16;
 
-	raw_iblt *riblt = new raw_iblt(*ibltslices);
-	if (!riblt->read(p, len))
+	std::unique_ptr<raw_iblt_view> view(new raw_iblt_view(*ibltslices, flags));
+	if (!view->read(p, len))
 		throw std::runtime_error("Bad iblt");
-	
-	return riblt;
+
+	return view;
 }
 
-static bool recover_block(const raw_iblt &theirs,
-						  const raw_iblt &ours,
-						  u64 seed,
-						  const txmap &mempool,
-						  txmap block)
+// Halves folded away by iblt-encode --topups, smallest first.
+static std::vector<raw_iblt> read_topups(std::istream &in, unsigned int flags,
+										 std::vector<size_t> *topup_bytes)
 {
-	// Difference iblt.
-	iblt diff(theirs, ours);
+	std::vector<raw_iblt> topups;
+
+	while (in.peek() == 't') {
+		std::string topupstr;
+		std::getline(in, topupstr, ',');
+		if (topupstr != "topup")
+			throw std::runtime_error("Bad topup line");
+
+		std::string topuphex;
+		std::getline(in, topuphex);
+		if (!in)
+			throw std::runtime_error("Bad topup hex line");
+
+		std::vector<u8> data(hex_data_size(topuphex.size()));
+		if (!hex_decode(topuphex.c_str(), topuphex.size(), data.data(), data.size()))
+			throw std::runtime_error("Bad topup hex");
+
+		const u8 *p = data.data();
+		size_t len = data.size();
+		size_t slices = pull_varint(&p, &len);
+		if (!p)
+			throw std::runtime_error("Bad topup size");
+
+		// Don't size a table from the varint until the data matches it.
+		size_t bucket_bytes = raw_iblt::WIRE_BYTES;
+		if (flags & raw_iblt::HASH_CHECK)
+			bucket_bytes += raw_iblt::CHECK_BYTES;
+		if (len % bucket_bytes || len / bucket_bytes != slices)
+			throw std::runtime_error("Bad topup length");
+
+		raw_iblt half(slices, flags);
+		if (!half.read(p, len))
+			throw std::runtime_error("Bad topup");
+		topups.push_back(half);
+		topup_bytes->push_back(data.size());
+	}
+	return topups;
+}
+
+// What we've recovered of a block so far (ctx holds our txs, as of
+// ctx.start(), and their slices).  If we get stuck, the diff can be
+// extend()ed and we carry on.  One does for every peer of every block.
+class recovery {
+public:
+	recovery(decode_context &ctx, const txmap &block)
+		: ctx(ctx), block(block), bad_tx(false), why("ok") { }
+
+	// Start on the block again, with nothing recovered.
+	void start(u64 seed)
+	{
+		bad_tx = false;
+		why = "ok";
+		ctx.restore_ours();
+		ctx.recovered.clear();
+		// Each tx is checked off against the block as soon as its last
+		// slice is peeled: a node could start validating it here.
+		ctx.assembler.reset(seed, [this](const txid48 &id, const bitcoin_tx &btx) {
+				if (block.find(btx.txid()) == block.end())
+					bad_tx = true;
+				ctx.recovered.push_back(id);
+			});
+	}
 
-	// Create ids from my mempool, using their seed.
-	ibltpool pool(seed, mempool);
+	// Peel until stuck: false if it's gone wrong, rather than stuck.
+	bool peel(iblt &diff, unsigned int nthreads);
 
+	// Have we got exactly the block?
+	bool done(const iblt &diff);
+
+	// Why peel() or done() said no, for --diagnostics.
+	const char *reason() const { return why; }
+
+private:
+	decode_context &ctx;
+	const txmap &block;
+	bool bad_tx;
+	const char *why;
+};
+
+bool recovery::peel(iblt &diff, unsigned int nthreads)
+{
 	iblt::bucket_type t;
 	txslice s;
 
-	// For each txid48, we keep all the slices.
-	std::set<txslice> slices;
+	// Peel in parallel rounds first; the loop below finishes off.  If
+	// that hits anything order-dependent, start again serially.
+	if (nthreads > 1) {
+		// On failure, peel() puts diff back itself.
+		ctx.assembler.checkpoint();
+		ctx.peeled_ours.clear();
+		auto ours = [this](const txid48 &id) { return ctx.our_tx(id); };
+		if (diff.peel(ctx.workers, nthreads, ours, &ctx.assembler,
+					  &ctx.peeled_ours)) {
+			for (const auto &id: ctx.peeled_ours)
+				ctx.remove_our_tx(id);
+		} else
+			ctx.assembler.rollback();
+	}
 
 	// While there are still singleton buckets...
 	while ((t = diff.next(s)) != iblt::NEITHER) {
 		if (t == iblt::OURS) {
-			auto it = pool.tx_by_txid48.find(s.get_txid48());
+			const tx *ours = ctx.our_tx(s.get_txid48());
 			// If we can't find it, we're corrupt.
-			if (it == pool.tx_by_txid48.end()) {
+			if (!ours) {
+				why = "unknown-ours";
 				return false;
 			} else {
 				// Remove entire tx.
-				diff.remove_our_tx(*it->second->btx, s.get_txid48());
+				diff.remove_our_tx(*ours, s.get_txid48());
 				// Make sure we make progress: remove it from consideration.
-				if (!pool.tx_by_txid48.erase(s.get_txid48()))
+				if (!ctx.remove_our_tx(s.get_txid48())) {
+					why = "unknown-ours";
 					return false;
+				}
 			}
 		} else if (t == iblt::THEIRS) {
-			// Gave us the same slice twice?  Fail.
-			if (!slices.insert(s).second) {
+			// Gave us the same slice twice, or a tx which won't
+			// rebuild?  Fail.
+			if (!ctx.assembler.add(s) || bad_tx) {
+				why = bad_tx ? "not-in-block" : "dup-slice";
 				return false;
 			}
 			diff.remove_their_slice(s);
 		}
 	}
+	return true;
+}
 
+bool recovery::done(const iblt &diff)
+{
 	// If we didn't empty it, we've failed decode.
 	if (!diff.empty()) {
+		why = "stuck";
 		return false;
 	}
 
-	// Try to assemble the slices into txs.
-	size_t count = 0;
-	std::vector<txslice> transaction;
-	std::vector<bitcoin_tx> recovered;
-
-	for (const auto &s: slices) {
-		if (count == 0) {
-			// Do we expect this to be the first fragment?
-			if (s.get_txid48().frag_base() != s.fragid) {
-				return false;
-			}
-			size_t num = s.slices_expected();
-			if (!num || num > 0xFFFF) {
-				return false;
-			}
-			transaction = std::vector<txslice>(num);
-			transaction[0] = s;
-			count = 1;
-		} else {
-			// Missing part of transaction?
-			if (s.txidbits != transaction[count-1].txidbits) {
-				return false;
-			}
-			// Fragment id wrong?
-			if (s.fragid != transaction[count-1].fragid + 1) {
-				return false;
-			}
-			transaction[count++] = s;
-		}
-		if (count == transaction.size()) {
-			// We recovered the entire transaction!
-			bitcoin_tx tx((varint_t)0, (varint_t)0);
-
-			if (!rebuild_tx(transaction, tx))
-				return false;
-
-			recovered.push_back(tx);
-			count = 0;
-		}
-	}
-
-	// Some left over?
-	if (count != 0) {
+	// Some txs missing slices, or not in the block?
+	if (!ctx.assembler.complete() || bad_tx) {
+		why = bad_tx ? "not-in-block" : "mismatch";
 		return false;
 	}
 
-	// The block contents should be equal to recovered + tx_by_txid48.
-	for (const auto &tx: recovered) {
-		if (!block.erase(tx.txid()))
-			return false;
-	}
-	for (const auto &pair: pool.tx_by_txid48) {
-		if (!block.erase(pair.second->txid))
+	// We shouldn't have recovered any tx we still think we have.
+	why = "mismatch";
+	for (const auto &id: ctx.recovered) {
+		if (ctx.our_tx(id))
 			return false;
 	}
-	return block.empty();
+
+	// The rest of the block should be our txs which are left.
+	size_t count = ctx.recovered.size();
+	bool ok = true;
+	ctx.for_each_our_tx([this, &ok, &count](const tx *t) {
+			if (block.find(t->txid) == block.end())
+				ok = false;
+			count++;
+		});
+	if (!ok || count != block.size())
+		return false;
+	why = "ok";
+	return true;
 }
 
 int main(int argc, char *argv[])
 {
+	unsigned int nthreads = 1;
+	bool fresh_topups = false, diagnostics = false;
+
+	while (argv[1] && strncmp(argv[1], "--", 2) == 0) {
+		char *endp;
+		if (strncmp(argv[1], "--threads=", strlen("--threads=")) == 0) {
+			nthreads = strtoul(argv[1] + strlen("--threads="), &endp, 10);
+			if (*endp || !nthreads)
+				errx(1, "Invalid --threads");
+		} else if (strcmp(argv[1], "--fresh-topups") == 0) {
+			fresh_topups = true;
+		} else if (strcmp(argv[1], "--diagnostics") == 0) {
+			diagnostics = true;
+		} else
+			errx(1, "Unknown argument %s", argv[1]);
+		argc--;
+		argv++;
+	}
+
+	if (argc > 2)
+		errx(1, "Usage: %s [--threads=<n>] [--fresh-topups] [--diagnostics]", argv[0]);
 	std::istream &in = input_file(argv[1]);
 
 	unsigned int blocknum, overhead;
 	txmap block;
+	// Reused for every peer of every block.
+	decode_context ctx;
 	std::unordered_map<bitcoin_txid, tx *> knowns;
+	recovery rec(ctx, block);
 
 	while (read_blockline(in, &blocknum, &overhead, &block, &knowns, NULL)) {
 		u64 seed;
 		size_t ibltslices;
-		raw_iblt *theirs = read_iblt(in, &ibltslices, &seed);
+		std::vector<u8> ibltbuf;
+		std::unique_ptr<raw_iblt_view> theirs
+			= read_iblt(in, &ibltbuf, &ibltslices, &seed);
+		std::vector<size_t> topup_bytes;
+		std::vector<raw_iblt> topups;
+		if (theirs)
+			topups = read_topups(in, theirs->flags(), &topup_bytes);
 
 		txmap mempool;
 		std::string peername;
@@ -179,16 +284,61 @@ int main(int argc, char *argv[])
 			if (!theirs) {
 				std::cout << blocknum << "," << overhead << ",0,"
 						  << peername << ","
-						  << true
-						  << std::endl;
+						  << true;
+				if (diagnostics)
+					std::cout << ",ok,";
+				std::cout << std::endl;
 			} else {
-				// Create our equivalent iblt.
-				raw_iblt ours(theirs->size(), seed, mempool);
+				// Create our equivalent iblt, and subtract it from
+				// theirs in place.
+				iblt &diff = ctx.start(*theirs, seed, mempool, nthreads);
+				size_t bytes = overhead, slices = theirs->size();
+				rec.start(seed);
+				bool sane = rec.peel(diff, nthreads);
+				bool ok = sane && rec.done(diff);
+				// Where we got to, for --diagnostics.
+				iblt *cur_diff = &diff;
+				std::unique_ptr<iblt> fresh;
+
+				// Failed?  Ask for top-ups, one at a time.
+				if (!ok && !topups.empty()) {
+					raw_iblt cur(*theirs);
+
+					// Build ours at the largest size, fold down for each.
+					std::vector<raw_iblt> our_levels;
+					our_levels.push_back(raw_iblt(theirs->size() << topups.size(),
+												  seed, mempool, nthreads,
+												  theirs->flags()));
+					while (our_levels.size() < topups.size())
+						our_levels.insert(our_levels.begin(),
+										  our_levels.front().fold());
+
+					for (size_t i = 0; !ok && i < topups.size(); i++) {
+						cur = cur.unfold(topups[i]);
+						bytes += topup_bytes[i];
+						slices = cur.size();
+						if (sane && !fresh_topups) {
+							// Just stuck: carry on from where we were.
+							cur_diff->extend(topups[i], our_levels[i]);
+						} else {
+							// Went wrong: start again at this size.
+							fresh.reset(new iblt(cur, our_levels[i]));
+							cur_diff = fresh.get();
+							rec.start(seed);
+						}
+						sane = rec.peel(*cur_diff, nthreads);
+						ok = sane && rec.done(*cur_diff);
+					}
+				}
 
-				std::cout << blocknum << "," << overhead << "," << ibltslices
+				std::cout << blocknum << "," << bytes << "," << slices
 						  << "," << peername << ","
-						  << recover_block(*theirs, ours, seed, mempool, block)
-						  << std::endl;
+						  << ok;
+				if (diagnostics) {
+					std::cout << "," << rec.reason() << ",";
+					cur_diff->diagnose().write(std::cout);
+				}
+				std::cout << std::endl;
 			}
 		}
 	}
@@ -77,6 +77,66 @@ static struct buckets_for_slices bfors_table[] = {
 	{ 10000,12355 }
 };
 
+// The same for raw_iblt::SUBTABLES: utils/monte-carlo --sub-tables, with
+// --runs=100000 up to 100 slices, 10000 up to 1000, and 1000 beyond.
+static struct buckets_for_slices bfors_subtables_table[] = {
+	{ 1,3 },
+	{ 2,9 },
+	{ 3,12 },
+	{ 4,15 },
+	{ 5,18 },
+	{ 6,21 },
+	{ 7,24 },
+	{ 8,26 },
+	{ 9,28 },
+	{ 10,30 },
+	{ 11,32 },
+	{ 12,34 },
+	{ 13,36 },
+	{ 14,38 },
+	{ 15,40 },
+	{ 16,42 },
+	{ 17,44 },
+	{ 18,46 },
+	{ 19,48 },
+	{ 20,49 },
+	{ 21,51 },
+	{ 22,53 },
+	{ 23,55 },
+	{ 24,56 },
+	{ 25,57 },
+	{ 26,59 },
+	{ 27,60 },
+	{ 28,62 },
+	{ 29,63 },
+	{ 30,65 },
+	{ 40,80 },
+	{ 50,93 },
+	{ 60,105 },
+	{ 70,117 },
+	{ 80,128 },
+	{ 90,141 },
+	{ 100,152 },
+	{ 200,274 },
+	{ 300,398 },
+	{ 400,524 },
+	{ 500,649 },
+	{ 600,774 },
+	{ 700,899 },
+	{ 800,1022 },
+	{ 900,1148 },
+	{ 1000,1271 },
+	{ 2000,2511 },
+	{ 3000,3739 },
+	{ 4000,4977 },
+	{ 5000,6205 },
+	{ 6000,7437 },
+	{ 7000,8664 },
+	{ 8000,9896 },
+	{ 9000,11119 },
+	{ 10000,12351 }
+};
+
 // Base to assume how different their mempool is
 #ifndef INITIAL_SLICES
 /* This is txslice::num_slices_for(300) * 2 */
@@ -96,7 +156,8 @@ static struct buckets_for_slices bfors_table[] = {
 #define EXTRA_FACTOR 1.35
 #endif
 
-static size_t dynamic_buckets(const txmap &block, const txmap &mempool)
+static size_t dynamic_buckets(const txmap &block, const txmap &mempool,
+							  unsigned int flags)
 {
 	// Start with enough slices to decode two 300-byte txs.
 	size_t slices = INITIAL_SLICES;
@@ -105,17 +166,24 @@ static size_t dynamic_buckets(const txmap &block, const txmap &mempool)
 	for (const auto &pair: block) {
 		if (mempool.find(pair.first) != mempool.end())
 			continue;
-		slices += txslice::num_slices_for(pair.second->btx->length());
+		slices += txslice::num_slices_for(pair.second->length());
 	}
 
 	slices *= SLICE_FACTOR;
 
+	const struct buckets_for_slices *table = bfors_table;
+	size_t table_len = sizeof(bfors_table)/sizeof(bfors_table[0]);
+	if (flags & raw_iblt::SUBTABLES) {
+		table = bfors_subtables_table;
+		table_len = sizeof(bfors_subtables_table)/sizeof(bfors_subtables_table[0]);
+	}
+
 	// Find previous entry in table, use that factor to give 95% chance
 	double factor = 0;
-	for (size_t i = 0; i < sizeof(bfors_table)/sizeof(bfors_table[0]); i++) {
-		if (bfors_table[i].slices > slices)
+	for (size_t i = 0; i < table_len; i++) {
+		if (table[i].slices > slices)
 			break;
-		factor = (double)bfors_table[i].buckets / bfors_table[i].slices;
+		factor = (double)table[i].buckets / table[i].slices;
 	}
 
 	return slices * factor * EXTRA_FACTOR;
@@ -126,15 +194,19 @@ static size_t total_size(const txmap &block)
 	size_t sum = 0;
 
 	for (const auto &pair: block) {
-		sum += pair.second->btx->length();
+		sum += pair.second->length();
 	}
 	return sum;
 }
 
+// Most halves --topups will fold away.
+static const unsigned int MAX_TOPUPS = 4;
+
 int main(int argc, char *argv[])
 {
 	u64 seed = 1;
 	size_t fixed_buckets = 0;
+	unsigned int topups = 0, flags = 0;
 	bool do_iblt = true;
 
 	while (argv[1] && strncmp(argv[1], "--", 2) == 0) {
@@ -147,6 +219,18 @@ int main(int argc, char *argv[])
 			fixed_buckets = strtoul(argv[1] + strlen("--buckets="), &endp, 10);
 			if (*endp || !fixed_buckets)
 				errx(1, "Invalid --buckets");
+		} else if (strncmp(argv[1], "--topups=", strlen("--topups=")) == 0) {
+			topups = strtoul(argv[1] + strlen("--topups="), &endp, 10);
+			// Each doubles the table we build: past a few, a peer
+			// would do better with the block.
+			if (*endp || topups > MAX_TOPUPS)
+				errx(1, "Invalid --topups (max %u)", MAX_TOPUPS);
+		} else if (strcmp(argv[1], "--key-hash") == 0) {
+			flags |= raw_iblt::KEY_HASH;
+		} else if (strcmp(argv[1], "--subtables") == 0) {
+			flags |= raw_iblt::SUBTABLES;
+		} else if (strcmp(argv[1], "--hash-check") == 0) {
+			flags |= raw_iblt::HASH_CHECK;
 		} else if (strcmp(argv[1], "--no-iblt") == 0) {
 			do_iblt = false;
 		} else
@@ -156,7 +240,7 @@ int main(int argc, char *argv[])
 	}
 
 	if (argc > 2)
-			errx(1, "Usage: %s [--seed=<seed>][--buckets=buckets]", argv[0]);
+			errx(1, "Usage: %s [--seed=<seed>][--buckets=buckets][--topups=<n>][--key-hash][--subtables][--hash-check]", argv[0]);
 	std::istream &in = input_file(argv[1]);
 
 	unsigned int blocknum, overhead;
@@ -175,13 +259,24 @@ int main(int argc, char *argv[])
 		if (fixed_buckets) {
 			buckets = fixed_buckets;
 		} else {
-			buckets = dynamic_buckets(block, mempool);
+			buckets = dynamic_buckets(block, mempool, flags);
 		}
 
-		raw_iblt riblt(buckets, seed, block);
+		// Subtables only fold if each one halves evenly.
+		if (topups && (flags & raw_iblt::SUBTABLES))
+			buckets += (raw_iblt::NUM_HASHES - buckets % raw_iblt::NUM_HASHES) % raw_iblt::NUM_HASHES;
+
+		// Build it topups times bigger, and fold it down: peers who
+		// fail can be sent the halves we folded away, smallest first.
+		raw_iblt riblt(buckets << topups, seed, block, 1, flags);
+		std::vector<raw_iblt> halves;
+		for (unsigned int i = 0; i < topups; i++) {
+			halves.insert(halves.begin(), riblt.upper_half());
+			riblt = riblt.fold();
+		}
 
 		std::vector<u8> encoded;
-		add_varint(buckets, add_linearize, &encoded);
+		add_iblt_size(&encoded, buckets, flags);
 		// Seed will be 128 bits (FIXME: endian!)
 		u8 seedstr[16] = { 0 };
 		memcpy(seedstr, &seed, sizeof(seed));
@@ -201,6 +296,18 @@ int main(int argc, char *argv[])
 			char hexstr[hex_str_size(encoded.size())];
 			hex_encode(encoded.data(), encoded.size(), hexstr, sizeof(hexstr));
 			std::cout << "iblt," << hexstr << std::endl;
+
+			for (const auto &half: halves) {
+				std::vector<u8> topup;
+				add_varint(half.size(), add_linearize, &topup);
+				std::vector<u8> half_encoded = half.write();
+				topup.insert(topup.end(), half_encoded.begin(), half_encoded.end());
+
+				// Too big for the stack.
+				std::vector<char> tophex(hex_str_size(topup.size()));
+				hex_encode(topup.data(), topup.size(), tophex.data(), tophex.size());
+				std::cout << "topup," << tophex.data() << std::endl;
+			}
 		}
 
 		while (read_mempool(in, &peername, &mempool, &knowns, &unknowns)) {
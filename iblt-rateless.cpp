@@ -0,0 +1,138 @@
+// This code takes blocks and mempools (like iblt-encode), and for each
+// peer streams rateless coded symbols of the block until it decodes.
+// It produces output as (like iblt-decode):
+// blocknum,bytes,symbols,peername,[0|1]
+
+extern "C" {
+#include <ccan/err/err.h>
+}
+#include "io.h"
+#include "rateless.h"
+#include "txslice.h"
+#include <unordered_set>
+
+typedef std::unordered_map<txid48, const tx *> txid48map;
+
+// Do the slices we've peeled give exactly the block?  mine is our
+// mempool by txid48.
+static bool check_block(const rateless_decoder &dec, u64 seed,
+						const txid48map &mine, const txmap &block)
+{
+	bool ok = true;
+	size_t count = 0;
+
+	// Their txs should be in the block, and not ones we already had.
+	tx_assembler slices(seed, [&](const txid48 &id, const bitcoin_tx &btx) {
+			if (block.find(btx.txid()) == block.end()
+				|| mine.find(id) != mine.end())
+				ok = false;
+			count++;
+		});
+	for (const auto &s: dec.theirs()) {
+		if (!slices.add(s))
+			return false;
+	}
+	if (!ok || !slices.complete())
+		return false;
+
+	// Ours not in the block should have come out whole.
+	std::unordered_map<txid48, size_t> removed;
+	for (const auto &s: dec.ours())
+		removed[s.get_txid48()]++;
+	for (const auto &r: removed) {
+		auto it = mine.find(r.first);
+		if (it == mine.end()
+			|| r.second != slice_tx(*it->second, r.first).size())
+			return false;
+	}
+
+	// And the rest of ours should be in the block.
+	for (const auto &m: mine) {
+		if (removed.count(m.first))
+			continue;
+		if (block.find(m.second->txid) == block.end())
+			return false;
+		count++;
+	}
+	return count == block.size();
+}
+
+static size_t total_size(const txmap &block)
+{
+	size_t sum = 0;
+
+	for (const auto &pair: block) {
+		sum += pair.second->length();
+	}
+	return sum;
+}
+
+int main(int argc, char *argv[])
+{
+	u64 seed = 1;
+
+	while (argv[1] && strncmp(argv[1], "--", 2) == 0) {
+		char *endp;
+		if (strncmp(argv[1], "--seed=", strlen("--seed=")) == 0) {
+			seed = strtoul(argv[1] + strlen("--seed="), &endp, 10);
+			if (*endp || !seed)
+				errx(1, "Invalid --seed");
+		} else
+			errx(1, "Unknown argument %s", argv[1]);
+		argc--;
+		argv++;
+	}
+
+	if (argc > 2)
+		errx(1, "Usage: %s [--seed=<seed>]", argv[0]);
+	std::istream &in = input_file(argv[1]);
+
+	unsigned int blocknum, overhead;
+	txmap block;
+	std::unordered_set<bitcoin_txid> unknowns;
+	std::unordered_map<bitcoin_txid, tx *> knowns;
+
+	while (read_blockline(in, &blocknum, &overhead, &block, &knowns, &unknowns)) {
+		std::string peername;
+		txmap mempool;
+
+		// First peer is the one sending the block, as for iblt-encode.
+		if (!read_mempool(in, &peername, &mempool, &knowns, &unknowns))
+			errx(1, "Failed reading first mempool line");
+
+		size_t blocksz = total_size(block);
+		while (read_mempool(in, &peername, &mempool, &knowns, &unknowns)) {
+			rateless_encoder enc;
+			rateless_decoder dec;
+			txid48map mine;
+
+			// Once per peer: check_block() runs on every symbol.
+			for (const auto &pair: mempool)
+				mine.insert(std::make_pair(txid48(seed, pair.first), pair.second));
+
+			for (const auto &pair: block) {
+				for (const auto &s: slice_tx(*pair.second, txid48(seed, pair.first)))
+					enc.add(s);
+			}
+			for (const auto &pair: mine) {
+				for (const auto &s: slice_tx(*pair.second, pair.first))
+					dec.add_ours(s);
+			}
+
+			// Seed, then symbols until they tell us to stop; past the
+			// size of the block itself, they give up.
+			size_t bytes = 16;
+			bool ok = false;
+			while (!ok && bytes < blocksz) {
+				bytes += coded_symbol::WIRE_BYTES;
+				ok = dec.add_symbol(enc.next())
+					&& check_block(dec, seed, mine, block);
+			}
+
+			std::cout << blocknum << "," << overhead + bytes << ","
+					  << dec.received() << "," << peername << ","
+					  << ok
+					  << std::endl;
+		}
+	}
+}
@@ -52,7 +52,7 @@ static bool try_iblt(size_t buckets, unsigned int seed,
 				return false;
 			else {
 				// Remove entire tx.
-				diff.remove_our_tx(*it->second->btx, s.get_txid48());
+				diff.remove_our_tx(*it->second, s.get_txid48());
 				// Make sure we make progress: remove it from consideration.
 				minus_txids.erase(s.get_txid48());
 			}
@@ -98,8 +98,14 @@ static bool try_iblt(size_t buckets, unsigned int seed,
 			transaction[count++] = s;
 		}
 		if (count == transaction.size()) {
-			// We recovered the entire transaction!
-			// FIXME: Reconstruct tx, check id48 correct.
+			// We recovered the entire transaction: is it the one its
+			// txid48 says?
+			bitcoin_tx btx((varint_t)0, (varint_t)0);
+			bool ok = rebuild_tx(transaction, seed, btx);
+			btx.release();
+			if (!ok) {
+				return false;
+			}
 			count = 0;
 		}
 	}
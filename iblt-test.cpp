@@ -14,15 +14,23 @@ extern "C" {
 #include "ibltpool.h"
 #include "txcache.h"
 #include "txtree.h"
+#include "workers.h"
 #include <iostream>
 
 static bool verbose;
+static unsigned int iblt_flags;
+// Decode several guesses at their candidate set at once.
+static bool multi_hypothesis;
+// How many seeds ahead each mempool keeps a live IBLT for.
+static const u64 LIVE_SEEDS = 2;
 
 struct peer {
 	mempool mp;
 	int infd;
 	const char *file;
 	struct corpus_entry e;
+	// Threads for decode_block()'s hypotheses, kept from block to block.
+	worker_pool workers;
 
 	peer() : infd(-1) { }
 
@@ -61,7 +69,7 @@ generate_block(peer &p, size_t blocknum, u64 seed,
 	cb = get_tx(txid_from_corpus(p.e));
 
 	std::unordered_set<const tx *> block;
-	size_t blocksize = cb->btx->length(), unknown = 0, known = 0;
+	size_t blocksize = cb->length(), unknown = 0, known = 0;
 
 	// Top up mempool with any txs we didn't know, get all txs in the block.
 	while (p.next_entry()) {
@@ -77,15 +85,15 @@ generate_block(peer &p, size_t blocknum, u64 seed,
 			t = get_tx(txid);
 			p.mp.add(t);
 			block.insert(t);
-			blocksize += t->btx->length();
-			unknown += t->btx->length();
+			blocksize += t->length();
+			unknown += t->length();
 			break;
 		}
 		case KNOWN: {
 			t = p.mp.find(txid_from_corpus(p.e));
 			block.insert(t);
-			blocksize += t->btx->length();
-			known += t->btx->length();
+			blocksize += t->length();
+			known += t->length();
 			break;
 		}
 		default:
@@ -146,16 +154,20 @@ generate_block(peer &p, size_t blocknum, u64 seed,
 }
 
 // Debugger attach point;
-static bool fail(const peer &p,
+static bool fail(const peer &p, const iblt &diff,
 				 size_t blocknum, size_t txs_discarded, size_t slices_recovered)
 {
-	if (verbose)
+	if (verbose) {
 		std::cout << std::string(p.file)
 				  << ":" << blocknum
 				  << ":FAILED"
 				  << ": transactions removed " << txs_discarded
 				  << ", slices recovered " << slices_recovered
-				  << std::endl;
+				  << ", ";
+		// What's left, and what we're stuck on.
+		diff.diagnose().write(std::cout);
+		std::cout << std::endl;
+	}
 	return false;
 }
 
@@ -168,11 +180,15 @@ static raw_iblt wire_decode(const std::vector<u8> &incoming,
 {
     size_t len = incoming.size();
     const u8 *p = incoming.data();
-    varint_t size;
+    size_t size;
+    unsigned int flags;
 
     seed = pull_varint(&p, &len);
     min_fee_per_byte = pull_varint(&p, &len);
-    size = pull_varint(&p, &len);
+    if (!pull_iblt_size(&p, &len, &size, &flags))
+        throw std::runtime_error("bad size");
+    if (flags & ~raw_iblt::KNOWN_FLAGS)
+        throw std::runtime_error("unknown flags");
     coinbase = bitcoin_tx(&p, &len);
     
     if (!decode_bitset(&p, &len, added) || !decode_bitset(&p, &len, removed))
@@ -182,7 +198,7 @@ static raw_iblt wire_decode(const std::vector<u8> &incoming,
     if (size > 100 * 1024 * 1024 / IBLT_SIZE)
         throw std::runtime_error("bad size");
 
-    raw_iblt iblt(size);
+    raw_iblt iblt(size, flags);
     // Fails if not exactly the right amount left.
     if (!iblt.read(p, len))
         throw std::runtime_error("bad iblt");
@@ -190,57 +206,83 @@ static raw_iblt wire_decode(const std::vector<u8> &incoming,
     return iblt;
 }
 
-static bool decode_block(const peer &p, const std::vector<u8> in, size_t blocknum, size_t &slices_recovered, size_t &slices_discarded, size_t &txs_discarded)
-{
-	bitcoin_tx cb(varint_t(0), varint_t(0));
-	u64 min_fee_per_byte;
-	u64 seed;
-	txbitsSet added, removed;
-
-	raw_iblt their_riblt = wire_decode(in, cb, min_fee_per_byte, seed, added, removed);
+// Our guess at which of our txs they built their IBLT from.
+struct hypothesis {
+	const char *name;
+	// Those of ours we think they left out.
+	std::unordered_set<const tx *> dropped;
 
-	// Create ids from my mempool, using their seed.
-	ibltpool pool(seed, p.mp.tx_by_txid);
+	// Filled in by peel_hypothesis().
+	iblt diff;
+	bool ok;
+	size_t slices_recovered, slices_discarded, txs_discarded;
+};
 
-	// Start building up candidates.
-	std::unordered_set<const tx *> candidates;
+// Everything (or with fee_cut, only those paying min_fee_per_byte),
+// less those they said to remove, plus those they said to add: we only
+// keep what that leaves out of our mempool, which is usually far
+// smaller.  below_fee is ours paying less than min_fee_per_byte.  A
+// prefix can match several of our txs, and only one (if any) is really
+// theirs: unless ambiguous, we leave those alone rather than acting on
+// all of them.
+static std::unordered_set<const tx *> guess_dropped(ibltpool &pool,
+													 const txbitsSet &added,
+													 const txbitsSet &removed,
+													 const std::vector<const tx *> &below_fee,
+													 u64 min_fee_per_byte,
+													 bool fee_cut, bool ambiguous)
+{
+	std::unordered_set<const tx *> dropped;
 
-	// First, take all which exceed the given satoshi_per_byte.
-	for (const auto it: pool.tx_by_txid48) {
-		candidates.insert(it.second);
-	}
+	// First, leave out all which don't meet the given satoshi_per_byte.
+	if (fee_cut)
+		dropped.insert(below_fee.begin(), below_fee.end());
 
-	// Now, remove any which they explicity said to remove
-	size_t num_removed = 0;
+	// Now, leave out any which they explicity said to remove
     for (const auto &s: removed) {
         for (const auto &vec : s) {
 			// We can have more than one match: remove them all.
-			for (const auto &t: pool.get_txs(vec)) {
-				if (candidates.erase(t)) {
-					num_removed++;
-				}
-			}
+			std::vector<const tx *> txs = pool.get_txs(vec);
+			if (txs.size() > 1 && !ambiguous)
+				continue;
+			for (const auto &t: txs)
+				dropped.insert(t);
 		}
 	}
 
-	// Add any they said to add.
+	// Put back any they said to add.
     for (const auto &s: added) {
         for (const auto &vec : s) {
 			// We can have more than one match: add those not already in
 			// due to fee-per-byte criterion.
-			for (const auto &t: pool.get_txs(vec)) {
+			std::vector<const tx *> txs = pool.get_txs(vec);
+			if (txs.size() > 1 && !ambiguous)
+				continue;
+			for (const auto &t: txs) {
 				if (t->satoshi_per_byte() < min_fee_per_byte) {
-					candidates.insert(t);
+					dropped.erase(t);
 				}
 			}
 		}
 	}
+	return dropped;
+}
 
-	// Put this into a raw iblt.
-	raw_iblt our_riblt(their_riblt.size(), seed, candidates);
+// Subtract our whole mempool (ours_all) from theirs, add back
+// h.dropped, and peel: true if we recover it all.  Doesn't touch
+// anything shared, so several can run at once.
+static bool peel_hypothesis(const raw_iblt &ours_all, const raw_iblt &their_riblt,
+							u64 seed, const ibltpool &pool, hypothesis &h)
+{
+	// Create iblt with differences: taking out what we think they
+	// left out puts it back.
+	iblt &diff = h.diff;
+	diff.reset(their_riblt, ours_all);
+	for (const auto &t: h.dropped)
+		diff.remove_our_tx(*t, txid48(seed, t->txid));
 
-	// Create iblt with differences.
-	iblt diff(their_riblt, our_riblt);
+	// Ours which we've removed so far.
+	std::unordered_set<txid48> gone;
 
 	iblt::bucket_type t;
 	txslice s;
@@ -248,6 +290,9 @@ static bool decode_block(const peer &p, const std::vector<u8> in, size_t blocknu
 	// For each txid48, we keep all the fragments.
 	std::set<txslice> slices;
 
+	size_t &txs_discarded = h.txs_discarded;
+	size_t &slices_recovered = h.slices_recovered;
+	size_t &slices_discarded = h.slices_discarded;
 	txs_discarded = 0;
 	slices_recovered = 0;
 	slices_discarded = 0;
@@ -257,19 +302,19 @@ static bool decode_block(const peer &p, const std::vector<u8> in, size_t blocknu
 		if (t == iblt::OURS) {
 			auto it = pool.tx_by_txid48.find(s.get_txid48());
 			// If we can't find it, we're corrupt.
-			if (it == pool.tx_by_txid48.end()) {
-				return fail(p, blocknum, txs_discarded, slices_recovered);
+			if (it == pool.tx_by_txid48.end() || gone.count(s.get_txid48())) {
+				return false;
 			} else {
 				// Remove entire tx.
-				slices_discarded += diff.remove_our_tx(*it->second->btx, s.get_txid48());
+				slices_discarded += diff.remove_our_tx(*it->second, s.get_txid48());
 				// Make sure we make progress: remove it from consideration.
-				pool.tx_by_txid48.erase(s.get_txid48());
+				gone.insert(s.get_txid48());
 				txs_discarded++;
 			}
 		} else if (t == iblt::THEIRS) {
 			// Gave us the same slice twice?  Fail.
 			if (!slices.insert(s).second) {
-				return fail(p, blocknum, txs_discarded, slices_recovered);
+				return false;
 			}
 			diff.remove_their_slice(s);
 			slices_recovered++;
@@ -278,7 +323,7 @@ static bool decode_block(const peer &p, const std::vector<u8> in, size_t blocknu
 
 	// If we didn't empty it, we've failed decode.
 	if (!diff.empty()) {
-		return fail(p, blocknum, txs_discarded, slices_recovered);
+		return false;
 	}
 
 	// Try to assemble the slices into txs.
@@ -289,11 +334,11 @@ static bool decode_block(const peer &p, const std::vector<u8> in, size_t blocknu
 		if (count == 0) {
 			// Do we expect this to be the first fragment?
 			if (s.get_txid48().frag_base() != s.fragid) {
-				return fail(p, blocknum, txs_discarded, slices_recovered);
+				return false;
 			}
 			size_t num = s.slices_expected();
 			if (!num || num > 0xFFFF) {
-				return fail(p, blocknum, txs_discarded, slices_recovered);
+				return false;
 			}
 			transaction = std::vector<txslice>(num);
 			transaction[0] = s;
@@ -301,34 +346,110 @@ static bool decode_block(const peer &p, const std::vector<u8> in, size_t blocknu
 		} else {
 			// Missing part of transaction?
 			if (s.txidbits != transaction[count-1].txidbits) {
-				return fail(p, blocknum, txs_discarded, slices_recovered);
+				return false;
 			}
 			// Fragment id wrong?
 			if (s.fragid != transaction[count-1].fragid + 1) {
-				return fail(p, blocknum, txs_discarded, slices_recovered);
+				return false;
 			}
 			transaction[count++] = s;
 		}
 		if (count == transaction.size()) {
-			// We recovered the entire transaction!
-			// FIXME: Reconstruct tx, check id48 correct.
+			// We recovered the entire transaction: is it the one its
+			// txid48 says?
+			bitcoin_tx btx((varint_t)0, (varint_t)0);
+			bool ok = rebuild_tx(transaction, seed, btx);
+			btx.release();
+			if (!ok) {
+				return false;
+			}
 			// FIXME: Reconstruct block!
 			count = 0;
 		}
 	}
 
 	// Some left over?
-	if (count != 0) {
-		return fail(p, blocknum, txs_discarded, slices_recovered);
+	return count == 0;
+}
+
+static bool decode_block(peer &p, const std::vector<u8> in, size_t blocknum, size_t &slices_recovered, size_t &slices_discarded, size_t &txs_discarded)
+{
+	bitcoin_tx cb(varint_t(0), varint_t(0));
+	u64 min_fee_per_byte;
+	u64 seed;
+	txbitsSet added, removed;
+
+	raw_iblt their_riblt = wire_decode(in, cb, min_fee_per_byte, seed, added, removed);
+
+	// Create ids from my mempool, using their seed.
+	ibltpool pool(seed, p.mp.tx_by_txid);
+
+	// Our whole mempool as an IBLT: if it's been kept up to date as
+	// transactions came in, we needn't build it now.
+	const raw_iblt *live = p.mp.iblt(their_riblt.size(), seed, their_riblt.flags());
+	raw_iblt built(0, their_riblt.flags());
+	if (!live) {
+		built = raw_iblt(their_riblt.size(), seed, p.mp.tx_by_txid,
+						 1, their_riblt.flags());
+		live = &built;
 	}
-	if (verbose)
-		std::cout << std::string(p.file)
-				  << ":" << blocknum
-				  << ":SUCCESS"
-				  << ": transactions removed " << txs_discarded
-				  << ", slices recovered " << slices_recovered
-				  << std::endl;
-	return true;
+
+	std::vector<const tx *> below_fee;
+	for (const auto &it: pool.tx_by_txid48) {
+		if (it.second->satoshi_per_byte() < min_fee_per_byte)
+			below_fee.push_back(it.second);
+	}
+
+	// Our best guess, and with --hypotheses, others in case a prefix
+	// or the fee cut-off misled us: we'd rather not ask again.
+	std::vector<hypothesis> guesses(multi_hypothesis ? 4 : 1);
+	guesses[0].name = "all";
+	guesses[0].dropped = guess_dropped(pool, added, removed, below_fee,
+	                                   min_fee_per_byte, false, true);
+	if (multi_hypothesis) {
+		guesses[1].name = "unambiguous";
+		guesses[1].dropped = guess_dropped(pool, added, removed, below_fee,
+		                                   min_fee_per_byte, false, false);
+		guesses[2].name = "fee-cut";
+		guesses[2].dropped = guess_dropped(pool, added, removed, below_fee,
+		                                   min_fee_per_byte, true, true);
+		guesses[3].name = "fee-cut,unambiguous";
+		guesses[3].dropped = guess_dropped(pool, added, removed, below_fee,
+		                                   min_fee_per_byte, true, false);
+	}
+
+	// Peel them all at once, one thread each.
+	p.workers.run(guesses.size(), [&](unsigned int i) {
+			guesses[i].ok = peel_hypothesis(*live, their_riblt, seed, pool,
+											guesses[i]);
+		});
+
+	// Take the first which worked, so the answer doesn't depend on
+	// which thread finished first.
+	for (const auto &h: guesses) {
+		if (!h.ok)
+			continue;
+		slices_recovered = h.slices_recovered;
+		slices_discarded = h.slices_discarded;
+		txs_discarded = h.txs_discarded;
+		if (verbose) {
+			std::cout << std::string(p.file)
+					  << ":" << blocknum
+					  << ":SUCCESS"
+					  << ": transactions removed " << txs_discarded
+					  << ", slices recovered " << slices_recovered;
+			if (multi_hypothesis)
+				std::cout << ", guess " << h.name;
+			std::cout << std::endl;
+		}
+		return true;
+	}
+
+	const hypothesis &h = guesses[0];
+	slices_recovered = h.slices_recovered;
+	slices_discarded = h.slices_discarded;
+	txs_discarded = h.txs_discarded;
+	return fail(p, h.diff, blocknum, txs_discarded, slices_recovered);
 }
 
 static bool maybe_orphan(size_t blocknum)
@@ -446,7 +567,7 @@ static std::vector<u8> wire_encode(const bitcoin_tx &coinbase,
 
     add_varint(seed, add_linearize, &arr);
     add_varint(min_fee_per_byte, add_linearize, &arr);
-    add_varint(iblt.size(), add_linearize, &arr);
+    add_iblt_size(&arr, iblt.size(), iblt.flags());
     coinbase.add_tx(add_linearize, &arr);
 
     add_bitset(&arr, added);
@@ -463,51 +584,105 @@ static size_t min_decode(std::unordered_set<const tx *> block,
 					  const txbitsSet &removed,
 					  u64 min_fee_per_byte,
 					  const bitcoin_tx &cb,
-					  const peer &p, u64 seed, size_t blocknum,
+					  peer &p, u64 seed, size_t blocknum,
 					  size_t &iblt_slices, size_t &slices_recovered,
 					  size_t &slices_discarded, size_t &txs_discarded)
 {
 	// Try up to 16MB worth of IBLT.
 	const size_t max_possible = 16 * 1024 * 1024 / IBLT_SIZE;
-	size_t min_buckets = 1, max_buckets = max_possible;
-	size_t num, data_size = 16 * 1024 * 1024;
+	size_t data_size = 16 * 1024 * 1024;
 
 	slices_recovered = txs_discarded = slices_discarded = iblt_slices = 0;
-	while (min_buckets != max_buckets) {
-		num = (min_buckets + max_buckets) / 2;
-		raw_iblt riblt(num, seed, block);
+
+	// Returns true (and records results) if this one decodes.
+	auto try_decode = [&](const raw_iblt &riblt) {
 		size_t srecovered, sdiscarded, tdiscarded;
 
 		std::vector<u8> data = wire_encode(cb, min_fee_per_byte, seed,
 										   added, removed, riblt);
 
-		if (decode_block(p, data, blocknum, srecovered, sdiscarded, tdiscarded)) {
+		if (!decode_block(p, data, blocknum, srecovered, sdiscarded, tdiscarded))
+			return false;
+		data_size = data.size();
+		slices_recovered = srecovered;
+		slices_discarded = sdiscarded;
+		txs_discarded = tdiscarded;
+		iblt_slices = riblt.size();
+		return true;
+	};
+
+	// Build one table and fold it: levels[i] has base * 2^i buckets.
+	// Subtables only fold while each one halves evenly.
+	size_t base = (iblt_flags & raw_iblt::SUBTABLES) ? raw_iblt::NUM_HASHES : 1;
+	std::vector<raw_iblt> levels;
+	size_t top = base;
+	while (top * 2 <= max_possible)
+		top *= 2;
+	levels.push_back(raw_iblt(top, seed, block, 1, iblt_flags));
+	while (levels.front().size() > base)
+		levels.insert(levels.begin(), levels.front().fold());
+
+	// Complete failure?
+	if (!try_decode(levels.back()))
+		return data_size;
+
+	// Find smallest level which works.
+	size_t min_level = 0, max_level = levels.size() - 1;
+	while (min_level != max_level) {
+		size_t mid = (min_level + max_level) / 2;
+		if (try_decode(levels[mid]))
+			max_level = mid;
+		else
+			min_level = mid + 1;
+	}
+
+	// Now search between that and the (failed) one below it.
+	size_t max_buckets = levels[max_level].size();
+	size_t min_buckets = max_buckets / 2 + 1;
+	while (min_buckets < max_buckets) {
+		size_t num = (min_buckets + max_buckets) / 2;
+		raw_iblt riblt(num, seed, block, 1, iblt_flags);
+
+		if (try_decode(riblt))
 			max_buckets = num;
-			data_size = data.size();
-			slices_recovered = srecovered;
-			slices_discarded = sdiscarded;
-			txs_discarded = tdiscarded;
-			iblt_slices = riblt.size();
-		} else {
+		else
 			min_buckets = num + 1;
-			// Complete failure?
-			if (min_buckets == max_possible - 1) {
-				break;
-			}
-		}
 	}
 
 	return data_size;
 }
 
+// Try a single fixed-size IBLT: returns bytes sent, or 0 on failure.
+static size_t fixed_decode(const std::unordered_set<const tx *> &block,
+						   const txbitsSet &added,
+						   const txbitsSet &removed,
+						   u64 min_fee_per_byte,
+						   const bitcoin_tx &cb,
+						   peer &p, u64 seed, size_t blocknum,
+						   size_t buckets,
+						   size_t &iblt_slices, size_t &slices_recovered,
+						   size_t &slices_discarded, size_t &txs_discarded)
+{
+	raw_iblt riblt(buckets, seed, block, 1, iblt_flags);
+	std::vector<u8> data = wire_encode(cb, min_fee_per_byte, seed,
+									   added, removed, riblt);
+
+	iblt_slices = riblt.size();
+	if (!decode_block(p, data, blocknum, slices_recovered, slices_discarded, txs_discarded))
+		return 0;
+	return data.size();
+}
+
 int main(int argc, char *argv[])
 {
 	// 352792 to 352810 is a time of backlog, so include that.
 	size_t blocknum = 352720, end = 352820;
 	u64 seed = 0;
+	size_t fixed_buckets = 0;
+	bool fixed_seed = false;
 
 	if (argc < 3)
-		errx(1, "Usage: %s [--range=a,b] [--seed=<seed>] <generator-corpus> <peer-corpus>...", argv[0]);
+		errx(1, "Usage: %s [--range=a,b] [--seed=<seed>] [--fixed-seed] [--buckets=<buckets>] [--key-hash] [--subtables] [--hash-check] [--hypotheses] <generator-corpus> <peer-corpus>...", argv[0]);
 
 	while (strncmp(argv[1], "--", 2) == 0) {
 		char *endp;
@@ -522,6 +697,20 @@ int main(int argc, char *argv[])
 			seed = strtoul(argv[1] + strlen("--seed="), &endp, 10);
 			if (*endp || !seed)
 				errx(1, "Invalid --seed");
+		} else if (strcmp(argv[1], "--key-hash") == 0) {
+			iblt_flags |= raw_iblt::KEY_HASH;
+		} else if (strcmp(argv[1], "--subtables") == 0) {
+			iblt_flags |= raw_iblt::SUBTABLES;
+		} else if (strcmp(argv[1], "--hash-check") == 0) {
+			iblt_flags |= raw_iblt::HASH_CHECK;
+		} else if (strcmp(argv[1], "--hypotheses") == 0) {
+			multi_hypothesis = true;
+		} else if (strcmp(argv[1], "--fixed-seed") == 0) {
+			fixed_seed = true;
+		} else if (strncmp(argv[1], "--buckets=", strlen("--buckets=")) == 0) {
+			fixed_buckets = strtoul(argv[1] + strlen("--buckets="), &endp, 10);
+			if (*endp || !fixed_buckets)
+				errx(1, "Invalid --buckets");
 		} else
 			errx(1, "Unknown argument %s", argv[1]);
 		argc--;
@@ -540,6 +729,13 @@ int main(int argc, char *argv[])
 		if (!p.open(argv[argnum++]))
 			err(1, "Opening %s", argv[argnum-1]);
 		forward_to_block(p, blocknum);
+		// With a known size, mempools can keep the IBLT for each of
+		// the next few seeds up to date as transactions arrive.
+		if (fixed_buckets) {
+			for (u64 i = 1; i <= (fixed_seed ? 1 : LIVE_SEEDS); i++)
+				p.mp.attach_iblt(fixed_buckets, fixed_seed ? seed : seed + i,
+								 iblt_flags);
+		}
 	}
 
 	std::cout << "blocknum,blocksize,knownbytes,unknownbytes,mempoolbytes,addedbitsetsize,removedbitsetsize";
@@ -558,7 +754,8 @@ int main(int argc, char *argv[])
 	std::cout << std::endl;
 
 	do {
-		seed++;
+		if (!fixed_seed)
+			seed++;
 		
 		// Peer 0 generates a block.
 		txbitsSet added, removed;
@@ -572,7 +769,15 @@ int main(int argc, char *argv[])
 		// See how small we can encode it for each peer.
 		for (size_t i = 1; i < num_pools; i++) {
 			size_t iblt_slices, slices_recovered, slices_discarded, txs_discarded;
-			size_t min_size = min_decode(block, added, removed,
+			size_t min_size;
+			if (fixed_buckets)
+				min_size = fixed_decode(block, added, removed,
+										min_fee_per_byte, *coinbase->btx,
+										peers[i],
+										seed, blocknum, fixed_buckets,
+										iblt_slices, slices_recovered, slices_discarded, txs_discarded);
+			else
+				min_size = min_decode(block, added, removed,
 									  min_fee_per_byte, *coinbase->btx,
 									  peers[i],
 									  seed, blocknum,
@@ -581,7 +786,14 @@ int main(int argc, char *argv[])
 		}
 		std::cout << std::endl;
 		blocknum++;
-		for (auto &p : peers)
+		for (auto &p : peers) {
+			// That seed's done with: start on the one after the last
+			// we're keeping, and carry the rest forward.
+			if (fixed_buckets && !fixed_seed) {
+				p.mp.detach_iblt(fixed_buckets, seed, iblt_flags);
+				p.mp.attach_iblt(fixed_buckets, seed + LIVE_SEEDS, iblt_flags);
+			}
 			next_block(p, blocknum);
+		}
 	} while (blocknum != end);
 }
@@ -1,30 +1,81 @@
 #include "iblt.h"
+#include "xorbytes.h"
 #include <stdexcept>
 #include <algorithm>
+#include <thread>
 extern "C" {
 #include <ccan/ilog/ilog.h>
 }
 
-std::set<size_t> &iblt_todo::get_todo(u16 fragoff)
+size_t iblt_todo::get_prio(u16 fragoff)
 {
     if (fragoff <= SOON) {
-        return todo[fragoff];
+        return fragoff;
     } else {
-        return todo[SOON + ilog32(fragoff - SOON)];
+        return SOON + ilog32(fragoff - SOON);
     }
 }
 
+void iblt_todo::reset(size_t num)
+{
+    size_t off = 0;
+
+    level_off.clear();
+    do {
+        num = (num + 63) / 64;
+        level_off.push_back(off);
+        off += num;
+    } while (num > 1);
+
+    for (size_t i = 0; i < NUM_PRIOS; i++)
+        bits[i].assign(off, 0);
+    prios = 0;
+    manually_removed = false;
+}
+
 void iblt_todo::add(u16 fragoff, size_t bucket)
 {
-    if (!get_todo(fragoff).insert(bucket).second) {
+    size_t prio = get_prio(fragoff);
+    std::vector<u64> &b = bits[prio];
+
+    if (b[bucket / 64] & (1ULL << (bucket % 64))) {
         throw std::runtime_error("Bucket already in todo");
     }
+
+    // Set our bit, and each summary bit until one was already set.
+    for (size_t l = 0; l < level_off.size(); l++) {
+        u64 &word = b[level_off[l] + bucket / 64];
+        bool was_empty = (word == 0);
+
+        word |= 1ULL << (bucket % 64);
+        if (!was_empty)
+            break;
+        bucket /= 64;
+    }
+    prios |= 1U << prio;
 }
 
 void iblt_todo::del(u16 fragoff, size_t bucket, bool manual)
 {
-    if (!get_todo(fragoff).erase(bucket) && !manually_removed) {
-        throw std::runtime_error("Bucket not in todo");
+    size_t prio = get_prio(fragoff);
+    std::vector<u64> &b = bits[prio];
+
+    if (!(b[bucket / 64] & (1ULL << (bucket % 64)))) {
+        if (!manually_removed) {
+            throw std::runtime_error("Bucket not in todo");
+        }
+    } else {
+        // Clear our bit, and each summary bit until a word stays non-zero.
+        for (size_t l = 0; l < level_off.size(); l++) {
+            u64 &word = b[level_off[l] + bucket / 64];
+
+            word &= ~(1ULL << (bucket % 64));
+            if (word)
+                break;
+            bucket /= 64;
+        }
+        if (b[level_off.back()] == 0)
+            prios &= ~(1U << prio);
     }
     if (manual) {
         manually_removed = true;
@@ -35,42 +86,103 @@ size_t iblt_todo::next_todo() const
 {
     // First ones are sets of the same fragid, so don't need to sort.
     // Later are getting fairly desperate, so don't bother sorting.
-    for (size_t i = 0; i < sizeof(todo) / sizeof(todo[0]); i++) {
-        if (!todo[i].empty())
-            return i;
-    }
-    return (size_t)-1;
+    if (!prios)
+        return (size_t)-1;
+    return __builtin_ctz(prios);
 }
 
 size_t iblt_todo::next(size_t next_todo) const
 {
-    return *todo[next_todo].begin();
+    const std::vector<u64> &b = bits[next_todo];
+    size_t n = 0;
+
+    // Walk down from the top, taking the lowest set bit each time.
+    for (size_t l = level_off.size(); l > 0; l--)
+        n = n * 64 + __builtin_ctzll(b[level_off[l-1] + n]);
+    return n;
 }
 
 iblt::iblt(const raw_iblt &theirs, const raw_iblt &ours)
-    : riblt(theirs)
+    : false_singletons(0), bad_fragid(0), riblt(theirs)
+{
+    if (ours.size() != theirs.size()) {
+        throw std::runtime_error("IBLTs not same size");
+    }
+    if (ours.flags() != theirs.flags()) {
+        throw std::runtime_error("IBLTs not same flags");
+    }
+
+    // XOR the two, and subtract the counters.
+    riblt.subtract(ours);
+    init_todo();
+}
+
+iblt::iblt(const raw_iblt_view &theirs, raw_iblt &&ours)
+    : false_singletons(0), bad_fragid(0), riblt(std::move(ours))
+{
+    if (riblt.size() != theirs.size()) {
+        throw std::runtime_error("IBLTs not same size");
+    }
+    if (riblt.flags() != theirs.flags()) {
+        throw std::runtime_error("IBLTs not same flags");
+    }
+
+    // No copy of theirs: the difference lands in our table.
+    riblt.subtract_from(theirs);
+    init_todo();
+}
+
+void iblt::reset(const raw_iblt &theirs, const raw_iblt &ours)
 {
     if (ours.size() != theirs.size()) {
         throw std::runtime_error("IBLTs not same size");
     }
+    if (ours.flags() != theirs.flags()) {
+        throw std::runtime_error("IBLTs not same flags");
+    }
 
-    // FIXME: txslice as union!
-    u8 *dst = (u8 *)riblt.buckets.data();
-    const u8 *src = (u8 *)ours.buckets.data();
+    // Same size as last time, so this copies into our storage.
+    riblt = theirs;
+    riblt.subtract(ours);
+    peeled.clear();
+    peeled_dir.clear();
+    false_singletons = bad_fragid = 0;
+    init_todo();
+}
 
-    // XOR the two.
-    // FIXME: do this faster, of course, using alignment assumptions.
-    for (size_t i = 0; i < riblt.buckets.size() * sizeof(riblt.buckets[0]); i++) {
-        dst[i] ^= src[i];
+void iblt::reset(const raw_iblt_view &theirs, raw_iblt &ours)
+{
+    if (ours.size() != theirs.size()) {
+        throw std::runtime_error("IBLTs not same size");
+    }
+    if (ours.flags() != theirs.flags()) {
+        throw std::runtime_error("IBLTs not same flags");
     }
 
-    // Now fixup the counters.
-    for (size_t i = 0; i < riblt.counts.size(); i++) {
-        riblt.counts[i] -= ours.counts[i];
+    std::swap(riblt, ours);
+    riblt.subtract_from(theirs);
+    peeled.clear();
+    peeled_dir.clear();
+    false_singletons = bad_fragid = 0;
+    init_todo();
+}
+
+void iblt::init_todo()
+{
+    todo[OURS].reset(riblt.size());
+    todo[THEIRS].reset(riblt.size());
+    nonempty = 0;
+    for (size_t i = 0; i < riblt.size(); i++) {
         add_todo_if_singleton(i);
+        nonempty += !bucket_empty(i);
     }
 }
 
+bool iblt::bucket_empty(size_t n) const
+{
+    return riblt.counts[n] == 0 && riblt.bucket_empty(n);
+}
+
 void iblt::add_todo_if_singleton(size_t n)
 {
     enum bucket_type t;
@@ -83,9 +195,19 @@ void iblt::add_todo_if_singleton(size_t n)
         return;
     }
 
+    // With HASH_CHECK, we know a mix when we see one.
+    if (!riblt.bucket_check_ok(n)) {
+        false_singletons++;
+        return;
+    }
+
     // Offset by fragment index base, and add to todo list.
-    txid48 id = riblt.buckets[n].get_txid48();
-    todo[t].add(riblt.buckets[n].fragid - id.frag_base(), n);
+    txid48 id = riblt.bucket_txid48(n);
+    u16 fragoff = riblt.bucket_fragid(n) - id.frag_base();
+    // No tx goes that far: it's a mix, and the decode will fail on it.
+    if (fragoff >= MAX_TX_SLICES)
+        bad_fragid++;
+    todo[t].add(fragoff, n);
 }
 
 void iblt::remove_todo_if_singleton(size_t n)
@@ -100,19 +222,33 @@ void iblt::remove_todo_if_singleton(size_t n)
         return;
     }
 
+    // Bucket's unchanged since add_todo_if_singleton().
+    if (!riblt.bucket_check_ok(n))
+        return;
+
     // Offset by fragment index base, and remove from todo list.
-    txid48 id = riblt.buckets[n].get_txid48();
-    todo[t].del(riblt.buckets[n].fragid - id.frag_base(), n);
+    txid48 id = riblt.bucket_txid48(n);
+    todo[t].del(riblt.bucket_fragid(n) - id.frag_base(), n);
+}
+
+void iblt::frob_bucket(size_t n, const txslice &s, u16 check, int dir)
+{
+    bool was_empty = bucket_empty(n);
+
+    // We're about to change count; may take it off todo.
+    remove_todo_if_singleton(n);
+    riblt.frob_bucket(n, s, check, dir);
+    add_todo_if_singleton(n);
+
+    nonempty += (size_t)was_empty - (size_t)bucket_empty(n);
 }
 
 void iblt::frob_buckets(const txslice &s, int dir)
 {
-    std::vector<size_t> buckets = riblt.select_buckets(s);
+    std::array<size_t, raw_iblt::NUM_HASHES> buckets = riblt.select_buckets(s);
+    u16 check = riblt.slice_check(s);
     for (size_t i = 0; i < buckets.size(); i++) {
-        // We're about to change count; may take it off todo.
-        remove_todo_if_singleton(buckets[i]);
-        riblt.frob_bucket(buckets[i], s, dir);
-        add_todo_if_singleton(buckets[i]);
+        frob_bucket(buckets[i], s, check, dir);
     }
 }
 
@@ -143,7 +279,7 @@ enum iblt::bucket_type iblt::next(txslice &s) const
     assert(riblt.counts[n] == -dir);
 
     // Take a copy.
-    s = riblt.buckets[n];
+    s = riblt.bucket(n);
 
     // So they know whether it's a positive or negative.
     return t;
@@ -157,29 +293,475 @@ void iblt::remove_todo(bucket_type t, const txslice &s)
     todo[t].del(s.fragid - id.frag_base(), n, true);
 }
 
-bool iblt::empty() const
+size_t iblt::remove_our_tx(const tx &t, const txid48 &id)
 {
-    for (size_t i = 0; i < riblt.size(); i++) {
-        if (riblt.counts[i]) {
-            return false;
+    our_slices.clear();
+    slice_tx(t, id, &our_slices);
+
+    riblt.for_each_batch(our_slices.data(), our_slices.size(),
+                         [this](const size_t *pos, const txslice &s) {
+            u16 check = riblt.slice_check(s);
+            for (size_t i = 0; i < raw_iblt::NUM_HASHES; i++)
+                frob_bucket(pos[i], s, check, 1);
+        });
+    peeled.insert(peeled.end(), our_slices.begin(), our_slices.end());
+    peeled_dir.insert(peeled_dir.end(), our_slices.size(), 1);
+    return our_slices.size();
+}
+
+void iblt::remove_their_slice(const txslice &s)
+{
+    frob_buckets(s, -1);
+    peeled.push_back(s);
+    peeled_dir.push_back(-1);
+}
+
+void iblt::extend(const raw_iblt &their_upper, const raw_iblt &ours)
+{
+    if (ours.size() != riblt.size() * 2) {
+        throw std::runtime_error("IBLT extension not twice the size");
+    }
+    if (ours.flags() != riblt.flags() || their_upper.flags() != riblt.flags()) {
+        throw std::runtime_error("IBLTs not same flags");
+    }
+
+    // At the new size, the difference would be theirs - ours, with
+    // what we've peeled taken out: take that from ours.
+    raw_iblt taken(ours);
+    for (size_t i = 0; i < peeled.size(); i++)
+        taken.frob_buckets(peeled[i], -peeled_dir[i]);
+
+    raw_iblt upper(their_upper);
+    upper.subtract(taken.upper_half());
+    riblt = riblt.unfold(upper);
+    init_todo();
+}
+
+void iblt_diagnostics::write(std::ostream &out) const
+{
+    out << "buckets_left=" << buckets_left
+        << " singletons=" << singletons
+        << " false_singletons=" << false_singletons
+        << " bad_fragid=" << bad_fragid
+        << " stopping_set_estimate=" << stopping_set_estimate
+        << " counts=";
+    for (auto it = counts.begin(); it != counts.end(); ++it)
+        out << (it == counts.begin() ? "" : ";") << it->first << ":" << it->second;
+}
+
+iblt_diagnostics iblt::diagnose() const
+{
+    iblt_diagnostics d;
+    size_t weight = 0;
+
+    d.buckets_left = nonempty;
+    d.singletons = 0;
+    d.false_singletons = false_singletons;
+    d.bad_fragid = bad_fragid;
+    for (size_t n = 0; n < riblt.size(); n++) {
+        if (bucket_empty(n))
+            continue;
+        s16 c = riblt.counts[n];
+        d.counts[c]++;
+        if (c == 0) {
+            // Something and its opposite, at least.
+            weight += 2;
+        } else if (c == 1 || c == -1) {
+            txslice s = riblt.bucket(n);
+            std::array<size_t, raw_iblt::NUM_HASHES> pos = riblt.select_buckets(s);
+            d.singletons++;
+            // Not a single slice, so at least two and one opposite.
+            if ((u16)(s.fragid - s.get_txid48().frag_base()) >= MAX_TX_SLICES
+                || std::find(pos.begin(), pos.end(), n) == pos.end()
+                || !riblt.bucket_check_ok(n))
+                weight += 3;
+            else
+                weight++;
+        } else {
+            weight += c < 0 ? -c : c;
+        }
+    }
+    d.stopping_set_estimate = (weight + raw_iblt::NUM_HASHES - 1) / raw_iblt::NUM_HASHES;
+    return d;
+}
+
+// Don't bother with threads for less than this many slices in a round.
+static const size_t PARALLEL_PEEL_MIN = 64;
+
+// Run fn(thread, begin, end) across nthreads threads, splitting [0, num).
+template <typename F>
+static void parallel_for(worker_pool &workers, unsigned int nthreads,
+                         size_t num, const F &fn)
+{
+    workers.run(nthreads, [&](unsigned int t) {
+            fn(t, num * t / nthreads, num * (t + 1) / nthreads);
+        });
+}
+
+// 0 if we can't tell.
+static unsigned int num_cpus()
+{
+    static const unsigned int cpus = std::thread::hardware_concurrency();
+    return cpus;
+}
+
+// id.frag_base() is a SHA256, and a tx's slices all share one.
+static u16 cached_frag_base(std::vector<std::pair<u64, u16> > *cache,
+                            const txid48 &id)
+{
+    if (cache->empty())
+        cache->assign(256, std::make_pair(~0ULL, (u16)0));
+    std::pair<u64, u16> &c = (*cache)[id.get_id() % cache->size()];
+    if (c.first != id.get_id())
+        c = std::make_pair(id.get_id(), id.frag_base());
+    return c.second;
+}
+
+static bool by_id(const txid48 &a, const txid48 &b)
+{
+    return a.get_id() < b.get_id();
+}
+
+bool iblt::peel(worker_pool &workers, unsigned int nthreads,
+                const std::function<const tx *(const txid48 &)> &ours,
+                tx_assembler *theirs, std::vector<txid48> *removed)
+{
+    // prio[] for a bucket on no pending list, in this round, or changed
+    // this round (so it's on touched[] already).
+    const u8 NO_PRIO = 0xFF, TAKEN = 0xFE, CHANGED = 0xFD;
+    size_t mark = peeled.size();
+    size_t passed_check = false_singletons, passed_fragid = bad_fragid;
+    int dir = 0;
+    bool clash;
+
+    // More threads than CPUs just take turns.
+    if (num_cpus() && nthreads > num_cpus())
+        nthreads = num_cpus();
+    if (ps.workers.size() < nthreads)
+        ps.workers.resize(nthreads);
+    for (auto &w: ps.workers) {
+        if (w.work.size() < nthreads)
+            w.work.resize(nthreads);
+    }
+
+    // Drop what's changed since it went on this list (every change
+    // resets prio[], and puts it back on the right one if it's still a
+    // singleton), and repeats; mark the rest TAKEN.
+    auto still_pending = [&](std::vector<size_t> &v, int count, size_t p) {
+        size_t num = 0;
+        for (size_t n: v) {
+            if (riblt.counts[n] == count && ps.prio[n] == p) {
+                ps.prio[n] = TAKEN;
+                v[num++] = n;
+            }
+        }
+        v.resize(num);
+        return num != 0;
+    };
+
+    // Order matters after all: put the table back as we found it.
+    auto undo = [&]() {
+        for (size_t i = peeled.size(); i-- > mark; )
+            riblt.frob_buckets(peeled[i], -peeled_dir[i]);
+        peeled.resize(mark);
+        peeled_dir.resize(mark);
+        init_todo();
+        false_singletons = passed_check;
+        bad_fragid = passed_fragid;
+        return false;
+    };
+
+    // todo already has every singleton, checked, in bucket order.
+    ps.prio.assign(riblt.size(), NO_PRIO);
+    ps.prios = 0;
+    for (int t = OURS; t <= THEIRS; t++) {
+        const iblt_todo &td = todo[t];
+        size_t words = td.level_off.size() > 1 ? td.level_off[1] : 1;
+        for (size_t p = 0; p < iblt_todo::NUM_PRIOS; p++) {
+            ps.pending[t][p].clear();
+            for (size_t w = 0; w < words; w++) {
+                for (u64 b = td.bits[p][w]; b; b &= b - 1) {
+                    size_t n = w * 64 + __builtin_ctzll(b);
+                    ps.prio[n] = p;
+                    ps.pending[t][p].push_back(n);
+                    ps.prios |= 1U << p;
+                }
+            }
+        }
+    }
+    ps.removed.clear();
+
+    for (;;) {
+        // Like next(), the lowest priority, preferring ours on a draw;
+        // take everything of that type and priority, and leave the rest
+        // for later.
+        dir = 0;
+        ps.round.clear();
+        for (u32 m = ps.prios; m && !dir; m &= m - 1) {
+            size_t p = __builtin_ctz(m);
+            if (still_pending(ps.pending[OURS][p], -1, p)) {
+                dir = -1;
+                ps.round.swap(ps.pending[OURS][p]);
+            } else if (still_pending(ps.pending[THEIRS][p], 1, p)) {
+                dir = 1;
+                ps.round.swap(ps.pending[THEIRS][p]);
+            } else
+                ps.prios &= ~(1U << p);
         }
-        if (!riblt.buckets[i].empty()) {
-            return false;
+        if (!dir)
+            break;
+
+        // The same slice is often in several singleton buckets: sorted,
+        // the copies are next to each other, and only hashed once.
+        ps.slices.resize(ps.round.size());
+        ps.pos.resize(ps.round.size());
+        ps.order.resize(ps.round.size());
+        for (size_t i = 0; i < ps.round.size(); i++) {
+            ps.slices[i] = riblt.bucket(ps.round[i]);
+            ps.order[i] = i;
+        }
+        std::sort(ps.order.begin(), ps.order.end(), [this](size_t a, size_t b) {
+                return ps.slices[a] < ps.slices[b];
+            });
+
+        // A real singleton hashes to its own bucket; a mix of several
+        // slices which happens to count +/-1 rarely does, so we never
+        // take one.  But next() would, and what it does with it
+        // depends on order, so leave the rest to the serial loop.
+        clash = false;
+        for (size_t k = 0; k < ps.order.size(); k++) {
+            size_t i = ps.order[k], prev = k ? ps.order[k - 1] : 0;
+            if (k && !(ps.slices[prev] < ps.slices[i])
+                && !memcmp(ps.slices[prev].as_bytes(), ps.slices[i].as_bytes(),
+                           txslice::size()))
+                ps.pos[i] = ps.pos[prev];
+            else {
+                // Two different slices claiming the same place in a tx?
+                clash |= k && !(ps.slices[prev] < ps.slices[i]);
+                riblt.select_buckets(ps.slices[i], ps.pos[i].data());
+            }
+            if (std::find(ps.pos[i].begin(), ps.pos[i].end(), ps.round[i])
+                == ps.pos[i].end())
+                goto out;
+        }
+
+        const std::vector<txslice> *updates;
+        if (dir == 1) {
+            if (clash)
+                return undo();
+            ps.updates.clear();
+            ps.upos.clear();
+            for (size_t i: ps.order) {
+                const txslice &s = ps.slices[i];
+                if (!ps.updates.empty() && !(ps.updates.back() < s))
+                    continue;
+                if (!theirs->add(s))
+                    return undo();
+                ps.updates.push_back(s);
+                ps.upos.push_back(ps.pos[i]);
+            }
+            updates = &ps.updates;
+        } else {
+            ps.round_ours.clear();
+            for (const txslice &s: ps.slices)
+                ps.round_ours.push_back(s.get_txid48());
+            std::sort(ps.round_ours.begin(), ps.round_ours.end(), by_id);
+            ps.round_ours.erase(std::unique(ps.round_ours.begin(),
+                                            ps.round_ours.end()),
+                                ps.round_ours.end());
+            our_slices.clear();
+            for (const txid48 &id: ps.round_ours) {
+                const tx *t = ours(id);
+                if (!t || std::binary_search(ps.removed.begin(),
+                                             ps.removed.end(), id, by_id))
+                    return undo();
+                removed->push_back(id);
+                slice_tx(*t, id, &our_slices);
+            }
+            ps.removed.insert(ps.removed.end(), ps.round_ours.begin(),
+                              ps.round_ours.end());
+            std::sort(ps.removed.begin(), ps.removed.end(), by_id);
+            updates = &our_slices;
+        }
+
+        peeled.insert(peeled.end(), updates->begin(), updates->end());
+        peeled_dir.insert(peeled_dir.end(), updates->size(), -dir);
+
+        unsigned int n = updates->size() < PARALLEL_PEEL_MIN ? 1 : nthreads;
+
+        // Hash them all (THEIRS already are), handing each bucket change
+        // to the thread which owns that part of the table (work[from][to]),
+        // so each thread then only walks its own changes.
+        ps.checks.resize(updates->size());
+        for (unsigned int t = 0; t < n; t++) {
+            for (unsigned int to = 0; to < n; to++)
+                ps.workers[t].work[to].clear();
+        }
+        parallel_for(workers, n, updates->size(),
+                     [&](unsigned int t, size_t begin, size_t end) {
+                const txslice *u = updates->data();
+                auto place = [&](const size_t *pos, const txslice &s) {
+                    size_t i = &s - u;
+                    ps.checks[i] = riblt.slice_check(s);
+                    for (size_t h = 0; h < raw_iblt::NUM_HASHES; h++) {
+                        size_t owner = pos[h] * n / riblt.size();
+                        ps.workers[t].work[owner].push_back(std::make_pair(i, pos[h]));
+                    }
+                };
+                if (dir == 1) {
+                    for (size_t i = begin; i < end; i++)
+                        place(ps.upos[i].data(), u[i]);
+                } else
+                    riblt.for_each_batch(u + begin, end - begin, place);
+            });
+
+        workers.run(n, [&](unsigned int t) {
+                peel_scratch::worker &me = ps.workers[t];
+                me.nonempty = 0;
+                me.false_singletons = me.bad_fragid = 0;
+                me.touched.clear();
+                for (size_t from = 0; from < n; from++) {
+                    for (const auto &w: ps.workers[from].work[t]) {
+                        size_t b = w.second;
+                        bool was_empty = bucket_empty(b);
+                        riblt.frob_bucket(b, (*updates)[w.first],
+                                          ps.checks[w.first], -dir);
+                        me.nonempty += (ptrdiff_t)was_empty - (ptrdiff_t)bucket_empty(b);
+                        // A bucket changed twice is still one change.
+                        if (ps.prio[b] != CHANGED) {
+                            ps.prio[b] = CHANGED;
+                            me.touched.push_back(b);
+                        }
+                    }
+                }
+
+                // Like add_todo_if_singleton(), while they're still in
+                // cache: with HASH_CHECK, next() never sees a mix, so
+                // neither do we.
+                size_t num = 0;
+                for (size_t b: me.touched) {
+                    ps.prio[b] = NO_PRIO;
+                    if (riblt.counts[b] != 1 && riblt.counts[b] != -1)
+                        continue;
+                    if (!riblt.bucket_check_ok(b)) {
+                        me.false_singletons++;
+                        continue;
+                    }
+                    u16 fragoff = riblt.bucket_fragid(b)
+                        - cached_frag_base(&me.frag_bases, riblt.bucket_txid48(b));
+                    if (fragoff >= MAX_TX_SLICES)
+                        me.bad_fragid++;
+                    ps.prio[b] = iblt_todo::get_prio(fragoff);
+                    me.touched[num++] = b;
+                }
+                me.touched.resize(num);
+            });
+
+        for (unsigned int t = 0; t < n; t++) {
+            const peel_scratch::worker &w = ps.workers[t];
+            nonempty += w.nonempty;
+            false_singletons += w.false_singletons;
+            bad_fragid += w.bad_fragid;
+            for (size_t b: w.touched) {
+                ps.pending[riblt.counts[b] == -1 ? OURS : THEIRS][ps.prio[b]].push_back(b);
+                ps.prios |= 1U << ps.prio[b];
+            }
         }
     }
+
+out:
+    // We went behind todo's back: what's still pending is exactly what
+    // it should hold (plus the round we stopped at, if any).
+    todo[OURS].reset(riblt.size());
+    todo[THEIRS].reset(riblt.size());
+    auto give_back = [&](const std::vector<size_t> &v, int t) {
+        for (size_t n: v) {
+            if (ps.prio[n] == NO_PRIO || riblt.counts[n] != (t == OURS ? -1 : 1))
+                continue;
+            ps.prio[n] = NO_PRIO;
+            todo[t].add(riblt.bucket_fragid(n)
+                        - cached_frag_base(&ps.workers[0].frag_bases,
+                                           riblt.bucket_txid48(n)), n);
+        }
+    };
+    if (dir)
+        give_back(ps.round, dir == -1 ? OURS : THEIRS);
+    for (int t = OURS; t <= THEIRS; t++) {
+        for (size_t p = 0; p < iblt_todo::NUM_PRIOS; p++)
+            give_back(ps.pending[t][p], t);
+    }
     return true;
 }
 
-size_t iblt::remove_our_tx(const struct bitcoin_tx &btx, const txid48 &id)
+void decode_context::set_ours(u64 seed, const txmap &mempool)
 {
-    std::vector<txslice> v = slice_tx(btx, id);
-    for (const auto &s : v) {
-        frob_buckets(s, 1);
+    txs.clear();
+    ids.clear();
+    txids.clear();
+    for (const auto &t: mempool) {
+        txs.push_back(t.second);
+        txids.push_back(&t.first);
     }
-    return v.size();
+    txid48s.resize(txids.size());
+    txid48_batch(seed, txids.data(), txids.size(), txid48s.data());
+    for (size_t i = 0; i < txs.size(); i++)
+        ids.push_back(std::make_pair(txid48s[i], txs[i]));
+    // Txs sharing a txid48 all stay: find_ours() won't pick between them.
+    std::sort(ids.begin(), ids.end());
+    restore_ours();
 }
 
-void iblt::remove_their_slice(const txslice &s)
+iblt &decode_context::start(const raw_iblt_view &theirs, u64 seed,
+                            const txmap &mempool, unsigned int nthreads)
 {
-    frob_buckets(s, -1);
+    set_ours(seed, mempool);
+    ours.reset(theirs.size(), theirs.flags());
+    ours.build(seed, txs, nthreads);
+    // ours gets the last diff's table, for next time.
+    diff.reset(theirs, ours);
+    return diff;
+}
+
+iblt &decode_context::start(const raw_iblt &theirs, u64 seed,
+                            const txmap &mempool, unsigned int nthreads)
+{
+    set_ours(seed, mempool);
+    ours.reset(theirs.size(), theirs.flags());
+    ours.build(seed, txs, nthreads);
+    diff.reset(theirs, ours);
+    return diff;
+}
+
+size_t decode_context::find_ours(const txid48 &id) const
+{
+    auto it = std::lower_bound(ids.begin(), ids.end(),
+                               std::make_pair(id.get_id(), (const tx *)NULL));
+    if (it == ids.end() || it->first != id.get_id())
+        return ids.size();
+    // A clash: we can't tell which of them their bucket holds.
+    if (it + 1 != ids.end() && (it + 1)->first == id.get_id())
+        return ids.size();
+    return it - ids.begin();
+}
+
+const tx *decode_context::our_tx(const txid48 &id) const
+{
+    size_t i = find_ours(id);
+    if (i == ids.size() || removed[i])
+        return NULL;
+    return ids[i].second;
+}
+
+bool decode_context::remove_our_tx(const txid48 &id)
+{
+    size_t i = find_ours(id);
+    if (i == ids.size() || removed[i])
+        return false;
+    removed[i] = true;
+    return true;
+}
+
+void decode_context::restore_ours()
+{
+    removed.assign(ids.size(), false);
 }
@@ -3,8 +3,12 @@
 #include "txid48.h"
 #include "txslice.h"
 #include "rawiblt.h"
+#include "tx.h"
+#include "workers.h"
 #include <vector>
-#include <set>
+#include <map>
+#include <ostream>
+#include <functional>
 
 // We keep a postman-sorted TODO list of candidate buckets, based on
 // how low their fragid is.
@@ -15,31 +19,83 @@ private:
 	static const size_t SOON = 1U << SOON_LOG2;
 
 	// First contain fragids 0 to SOON-1, then powers of 2.
-	std::set<size_t> todo[SOON + 16 + 1];
+	static const size_t NUM_PRIOS = SOON + 16 + 1;
 
-	// Get the todo list for this frag offset
-	std::set<size_t> &get_todo(u16 fragoff);
+	// For each priority, a bitmap with a bit per bucket, then above
+	// that a bit per non-zero word of the level below, up to a single
+	// word.  level_off[] is where each level starts.
+	std::vector<u64> bits[NUM_PRIOS];
+	std::vector<size_t> level_off;
+
+	// Bit per non-empty priority.
+	u32 prios;
 
 	// Are we in sync with iblt?
 	bool manually_removed;
 
+	// iblt::peel() keeps its own lists, by the same priorities.
+	friend class iblt;
+
 public:
-	iblt_todo() { }
+	iblt_todo() : prios(0), manually_removed(false) { }
+
+	// Get the priority for this frag offset
+	static size_t get_prio(u16 fragoff);
+
+	// Empty it, ready for buckets 0 to num-1.  Nothing else allocates.
+	void reset(size_t num);
+
 	void add(u16 fragoff, size_t bucket);
 	void del(u16 fragoff, size_t bucket, bool manual = false);
 
 	// Returns (size_t)-1 if empty, otherwise a priority.
 	size_t next_todo() const;
 
-	// Call with results of (successful) next_todo.
+	// Call with results of (successful) next_todo: lowest bucket there.
 	size_t next(size_t next_todo) const;
 };
 
+// What's left in an iblt, for working out why a decode stopped.
+struct iblt_diagnostics {
+	// Buckets with anything in them.
+	size_t buckets_left;
+	// How many of those have each count.
+	std::map<int, size_t> counts;
+	// Buckets left at count 1 or -1.
+	size_t singletons;
+	// Over the whole decode, how often a bucket at count 1 or -1 was
+	// passed over as not a single slice, because it failed
+	// raw_iblt::HASH_CHECK; and how often one turned up with a fragid
+	// further from its txid48's frag_base() than any tx has slices
+	// (it's still peeled, and fails the decode).
+	size_t false_singletons, bad_fragid;
+	// At least how many slices we're stuck on (the stopping set).  Each
+	// is in NUM_HASHES buckets, and a bucket holds at least |count| of
+	// them: 2 if its count is 0 but it isn't empty, 3 if it's at 1 or -1
+	// but not a single slice.  Slices cancelling out within a bucket
+	// make it low, but it's 0 only once everything's gone.
+	size_t stopping_set_estimate;
+
+	// One line of key=value, for scripts.
+	void write(std::ostream &out) const;
+};
+
 class iblt {
 public:
 	// Construct by subtracting two raw IBLTs.
 	iblt(const raw_iblt &theirs, const raw_iblt &ours);
 
+	// Same, but straight from their wire buffer, reusing our table.
+	iblt(const raw_iblt_view &theirs, raw_iblt &&ours);
+
+	// Empty, to be reset() later.
+	iblt() : nonempty(0), false_singletons(0), bad_fragid(0), riblt(0) { }
+
+	// Start again with a new difference, keeping our storage.
+	void reset(const raw_iblt &theirs, const raw_iblt &ours);
+	// Same, swapping tables with ours: it gets our old one back.
+	void reset(const raw_iblt_view &theirs, raw_iblt &ours);
+
 	// Two kind of buckets are interesting: count == 1 (in theirs, not ours)
 	// and count == -1 (in ours, not theirs).
 	enum bucket_type {
@@ -51,29 +107,184 @@ public:
 	// Extract data from a slice.  Returns NEITHER if none avail.
 	bucket_type next(txslice &b) const;
 
-	// All done?  Not very cheap, so only call after next() fails.
-	bool empty() const;
+	// All done?
+	bool empty() const { return nonempty == 0; }
+
+	// How many buckets still have something in them (count or contents).
+	size_t buckets_left() const { return nonempty; }
+
+	// Look at what's left (walks the whole table).
+	iblt_diagnostics diagnose() const;
 
 	// Remove a single slice.
 	void remove_their_slice(const txslice &s);
 
 	// Remove an entire tx (returns slices removed)
-	size_t remove_our_tx(const struct bitcoin_tx &btx, const txid48 &id);
+	size_t remove_our_tx(const tx &t, const txid48 &id);
 
 	// If we don't remove anything, this cancels todo.
 	void remove_todo(bucket_type, const txslice &);
 
+	// Stuck?  Carry on at twice the size, keeping everything peeled so
+	// far: their_upper is the upper_half() of their IBLT at that size
+	// (an iblt-encode topup), ours our whole IBLT at that size.
+	void extend(const raw_iblt &their_upper, const raw_iblt &ours);
+
+	// Peel in rounds, across up to nthreads threads, before the usual
+	// next() loop.  Each round takes every singleton bucket of the type
+	// and todo priority next() would pick, all at once, then each thread
+	// applies the removals landing in its own range of buckets, so no
+	// two threads touch the same bucket.
+	// ours(id) finds our tx for an OURS bucket (NULL if we don't know
+	// it).  Their slices go to *theirs, and our txs removed into
+	// *removed.  Pure peeling gives the same result in any order.  A
+	// bucket which doesn't hash to itself is a mix, and never taken:
+	// once next() would pick one, we stop and return true, leaving the
+	// rest to the serial loop.  An unknown or repeated OURS txid48, or
+	// a slice seen twice, makes the outcome depend on order: then we
+	// put back everything this call peeled and return false, and the
+	// caller should rollback() *theirs (checkpoint() it first), forget
+	// *removed and start again with the serial loop.  Call it before
+	// next(): the serial loop's remove_todo() doesn't survive either way.
+	// The threads come from workers (so keep that from one call to the
+	// next), and there are never more than the machine has CPUs.
+	bool peel(worker_pool &workers, unsigned int nthreads,
+			  const std::function<const tx *(const txid48 &)> &ours,
+			  tx_assembler *theirs, std::vector<txid48> *removed);
+
 private:
+	// Fill in todo and nonempty from riblt.
+	void init_todo();
 	void add_todo_if_singleton(size_t bucket);
 	void remove_todo_if_singleton(size_t bucket);
 
+	bool bucket_empty(size_t bucket) const;
+
+	// Change a bucket, keeping todo and nonempty up to date.
+	void frob_bucket(size_t bucket, const txslice &s, u16 check, int dir);
 	void frob_buckets(const txslice &s, int dir);
 
 	// One for count == 1, one for count == -1.
 	iblt_todo todo[THEIRS + 1];
 
+	// Number of buckets for which bucket_empty() is false.
+	size_t nonempty;
+
+	// Singletons passed over, and impossible fragids seen, for diagnose().
+	size_t false_singletons, bad_fragid;
+
 	// Raw IBLT.
 	raw_iblt riblt;
+
+	// For remove_our_tx(), so slicing doesn't allocate each time.
+	std::vector<txslice> our_slices;
+
+	// Everything we've taken out, and which way, for extend().
+	std::vector<txslice> peeled;
+	std::vector<s8> peeled_dir;
+
+	// peel()'s scratch, kept so later calls (and rounds) needn't allocate.
+	struct peel_scratch {
+		// Singleton buckets not yet taken, by type and todo priority
+		// (may be stale: prio[] says which list each is on, if any).
+		std::vector<size_t> pending[THEIRS + 1][iblt_todo::NUM_PRIOS];
+		std::vector<u8> prio;
+		// Bit per priority which may have some pending, of either type.
+		u32 prios;
+		// This round's buckets, their slices and where those hash.
+		std::vector<size_t> round, order;
+		std::vector<txslice> slices;
+		std::vector<std::array<size_t, raw_iblt::NUM_HASHES> > pos;
+		// OURS txid48s this round, and so far.
+		std::vector<txid48> round_ours, removed;
+		// THEIRS slices we're taking out this round, and where they
+		// hash (OURS txs get sliced into our_slices, and hashed later),
+		// then the slice_check() of each.
+		std::vector<txslice> updates;
+		std::vector<std::array<size_t, raw_iblt::NUM_HASHES> > upos;
+		std::vector<u16> checks;
+		// Each thread's share of a round.
+		struct worker {
+			// Bucket changes for each owning thread (update index,
+			// bucket), then the buckets we changed which are now
+			// singletons.
+			std::vector<std::vector<std::pair<size_t, size_t> > > work;
+			std::vector<size_t> touched;
+			// What that did to nonempty, false_singletons, bad_fragid.
+			ptrdiff_t nonempty;
+			size_t false_singletons, bad_fragid;
+			// frag_base() by txid48, cached.
+			std::vector<std::pair<u64, u16> > frag_bases;
+		};
+		std::vector<worker> workers;
+	};
+	peel_scratch ps;
+};
+
+// Everything decoding needs, kept from one block to the next: once it
+// has seen a block this size, a decode allocates nothing but the txs it
+// recovers (iblt-bench's decode-allocs counts the rest).
+class decode_context {
+public:
+	decode_context() : ours(0) { }
+
+	// Build our IBLT from txs to match theirs, and the difference.
+	iblt &start(const raw_iblt_view &theirs, u64 seed, const txmap &txs,
+				unsigned int nthreads = 1);
+	iblt &start(const raw_iblt &theirs, u64 seed, const txmap &txs,
+				unsigned int nthreads = 1);
+
+	// Our tx with this txid48 (NULL if none, or removed).  If more than
+	// one of ours has it, that's NULL too: a bucket holding it could be
+	// any of them, so the decode fails as if we didn't know it.
+	const tx *our_tx(const txid48 &id) const;
+
+	// Take it out of consideration: false if it's not there.
+	bool remove_our_tx(const txid48 &id);
+
+	// Put back everything remove_our_tx() took out, to try again.
+	void restore_ours();
+
+	// Our txs which haven't been removed.
+	template <typename F>
+	void for_each_our_tx(F fn) const {
+		for (size_t i = 0; i < ids.size(); i++) {
+			if (!removed[i])
+				fn(ids[i].second);
+		}
+	}
+
+	// The difference, as of the last start().
+	iblt diff;
+
+	// Threads for diff.peel(): each context has its own, so decodes
+	// in different contexts don't wait for each other.
+	worker_pool workers;
+
+	// For the caller to clear() and fill each block, with the txs
+	// recovered from their slices.
+	std::vector<txid48> recovered;
+
+	// For the caller to reset() each decode, and add() their slices to.
+	tx_assembler assembler;
+
+	// For the our txs diff.peel() removes, so it needn't allocate.
+	std::vector<txid48> peeled_ours;
+
+private:
+	// Fill txs and ids from this mempool.
+	void set_ours(u64 seed, const txmap &mempool);
+	// Where id is in ids, or ids.size() if it isn't (or clashes).
+	size_t find_ours(const txid48 &id) const;
+
+	std::vector<const tx *> txs;
+	// Scratch for hashing txs' txid48s in one batch.
+	std::vector<const bitcoin_txid *> txids;
+	std::vector<u64> txid48s;
+	// Sorted by txid48.
+	std::vector<std::pair<u64, const tx *> > ids;
+	std::vector<bool> removed;
+	raw_iblt ours;
 };
 
 #endif // IBLT_H
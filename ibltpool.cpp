@@ -12,8 +12,18 @@ void ibltpool::add(const txid48 &id48, const tx *t)
 ibltpool::ibltpool(u64 s, const std::unordered_map<bitcoin_txid, const tx *> &tx_by_txid)
 	: seed(s), tree(new tx_tree())
 {
+	std::vector<const bitcoin_txid *> txids;
+	std::vector<const tx *> txs;
 	for (const auto &p : tx_by_txid) {
-		add(txid48(seed, p.first), p.second);
+		txids.push_back(&p.first);
+		txs.push_back(p.second);
+	}
+
+	// Hash them all at once: it's a SHA256 each.
+	std::vector<u64> ids(txids.size());
+	txid48_batch(seed, txids.data(), txids.size(), ids.data());
+	for (size_t i = 0; i < ids.size(); i++) {
+		add(txid48(ids[i]), txs[i]);
 	}
 }
 
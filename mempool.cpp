@@ -1,6 +1,27 @@
 #include "mempool.h"
+#include "txslice.h"
 #include <stdexcept>
 
+void mempool::add(const tx *t)
+{
+    if (tx_by_txid.insert(std::make_pair(t->txid, t)).second) {
+        for (auto &l: live)
+            l.table->insert_tx(*t, txid48(l.seed, t->txid));
+    }
+}
+
+bool mempool::del(const bitcoin_txid &txid)
+{
+    auto pos = tx_by_txid.find(txid);
+    if (pos == tx_by_txid.end()) {
+        return false;
+    }
+    for (auto &l: live)
+        l.table->remove_tx(*pos->second, txid48(l.seed, txid));
+    tx_by_txid.erase(pos);
+    return true;
+}
+
 const tx *mempool::find(const bitcoin_txid &id)
 {
     auto pos = tx_by_txid.find(id);
@@ -16,7 +37,46 @@ size_t mempool::length() const
 {
     size_t len = 0;
     for (const auto &i : tx_by_txid) {
-        len += i.second->btx->length();
+        len += i.second->length();
     }
     return len;
 }
+
+void mempool::attach_iblt(size_t size, u64 seed, unsigned int flags)
+{
+    if (iblt(size, seed, flags)) {
+        return;
+    }
+    live_iblt l = { new raw_iblt(size, seed, tx_by_txid, 1, flags), seed };
+    live.push_back(l);
+}
+
+void mempool::detach_iblt(size_t size, u64 seed, unsigned int flags)
+{
+    for (size_t i = 0; i < live.size(); i++) {
+        if (live[i].table->size() == size && live[i].seed == seed
+            && live[i].table->flags() == flags) {
+            delete live[i].table;
+            live.erase(live.begin() + i);
+            return;
+        }
+    }
+}
+
+void mempool::detach_iblt()
+{
+    for (auto &l: live)
+        delete l.table;
+    live.clear();
+}
+
+const raw_iblt *mempool::iblt(size_t size, u64 seed, unsigned int flags) const
+{
+    for (const auto &l: live) {
+        if (l.table->size() == size && l.seed == seed
+            && l.table->flags() == flags) {
+            return l.table;
+        }
+    }
+    return NULL;
+}
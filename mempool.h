@@ -4,6 +4,7 @@
 #include "bitcoin_tx.h"
 #include "txid48.h"
 #include "tx.h"
+#include "rawiblt.h"
 #include <vector>
 #include <map>
 #include <unordered_map>
@@ -15,17 +16,35 @@ public:
     std::unordered_map<bitcoin_txid, const tx *> tx_by_txid;
 
     mempool() { }
-    ~mempool() { }
-    void add(const tx *t) {
-        tx_by_txid.insert(std::make_pair(t->txid, t));
-    }
-    bool del(const bitcoin_txid &txid) {
-        return tx_by_txid.erase(txid) != 0;
-    }
+    ~mempool() { detach_iblt(); }
+    // Don't copy live.
+    mempool(const mempool &) = delete;
+    mempool &operator=(const mempool &) = delete;
+    void add(const tx *t);
+    bool del(const bitcoin_txid &txid);
     size_t size() const { return tx_by_txid.size(); }
     size_t length() const;
     
     // Membership check.
     const tx *find(const bitcoin_txid &id);
+
+    // Keep an IBLT of the whole mempool up to date as txs come and go:
+    // one for each seed you can predict, each built once when attached.
+    // Only worth it if you know the seed before the block arrives.
+    // Does nothing if one's already attached with this size and seed.
+    void attach_iblt(size_t size, u64 seed, unsigned int flags = 0);
+    // Drop that one (once its block has come), or all of them.
+    void detach_iblt(size_t size, u64 seed, unsigned int flags = 0);
+    void detach_iblt();
+
+    // The attached IBLT, if one matches this size, seed and flags (else NULL).
+    const raw_iblt *iblt(size_t size, u64 seed, unsigned int flags = 0) const;
+
+private:
+    struct live_iblt {
+        raw_iblt *table;
+        u64 seed;
+    };
+    std::vector<live_iblt> live;
 };
 #endif // MEMPOOL_H
@@ -4,6 +4,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "murmur.h"
+#include <vector>
 
 extern "C" {
 #include <ccan/endian/endian.h>
@@ -72,3 +73,234 @@ u32 MurmurHash3(u32 nHashSeed, const u8 *data, size_t len)
 
     return h1;
 }
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+static void murmur_seeds_scalar(u32 *out, size_t nseeds, const u8 *data, size_t len)
+{
+    for (size_t i = 0; i < nseeds; i++)
+        out[i] = MurmurHash3(i, data, len);
+}
+
+#ifdef HAVE_X86_KERNELS
+// The block mix depends only on the data, so we do that once, a vector
+// of blocks at a time, and only the h1 chain runs once per seed (lane).
+// x86 is little-endian, so plain loads give us le32.
+static const uint32_t murmur_c1 = 0xcc9e2d51;
+static const uint32_t murmur_c2 = 0x1b873593;
+
+static inline uint32_t murmur_tail(const u8 *tail, size_t n)
+{
+    uint32_t k1 = 0;
+
+    switch (n) {
+    case 3:
+        k1 ^= tail[2] << 16;
+    case 2:
+        k1 ^= tail[1] << 8;
+    case 1:
+        k1 ^= tail[0];
+        k1 *= murmur_c1;
+        k1 = ROTL32(k1, 15);
+        k1 *= murmur_c2;
+    };
+    return k1;
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i rotl_sse41(__m128i x, int r)
+{
+    return _mm_or_si128(_mm_slli_epi32(x, r), _mm_srli_epi32(x, 32 - r));
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i step_sse41(__m128i h, uint32_t k1)
+{
+    h = rotl_sse41(_mm_xor_si128(h, _mm_set1_epi32(k1)), 13);
+    // h * 5 + 0xe6546b64
+    return _mm_add_epi32(_mm_add_epi32(h, _mm_slli_epi32(h, 2)),
+                         _mm_set1_epi32(0xe6546b64));
+}
+
+__attribute__((target("sse4.1")))
+static void murmur_seeds_sse41(u32 *out, size_t nseeds, const u8 *data, size_t len)
+{
+    const size_t nblocks = len / 4;
+
+    for (size_t base = 0; base < nseeds; base += 4) {
+        __m128i h = _mm_setr_epi32(base, base + 1, base + 2, base + 3);
+        uint32_t k[4];
+        size_t i, j;
+
+        for (i = 0; i + 4 <= nblocks; i += 4) {
+            __m128i kv = _mm_loadu_si128((const __m128i *)(data + i * 4));
+            kv = _mm_mullo_epi32(kv, _mm_set1_epi32(murmur_c1));
+            kv = rotl_sse41(kv, 15);
+            kv = _mm_mullo_epi32(kv, _mm_set1_epi32(murmur_c2));
+            _mm_storeu_si128((__m128i *)k, kv);
+            for (j = 0; j < 4; j++)
+                h = step_sse41(h, k[j]);
+        }
+        for (; i < nblocks; i++) {
+            uint32_t k1;
+            memcpy(&k1, data + i * 4, 4);
+            k1 *= murmur_c1;
+            k1 = ROTL32(k1, 15);
+            k1 *= murmur_c2;
+            h = step_sse41(h, k1);
+        }
+        if (len & 3)
+            h = _mm_xor_si128(h, _mm_set1_epi32(murmur_tail(data + nblocks * 4, len & 3)));
+
+        h = _mm_xor_si128(h, _mm_set1_epi32(len));
+        h = _mm_xor_si128(h, _mm_srli_epi32(h, 16));
+        h = _mm_mullo_epi32(h, _mm_set1_epi32(0x85ebca6b));
+        h = _mm_xor_si128(h, _mm_srli_epi32(h, 13));
+        h = _mm_mullo_epi32(h, _mm_set1_epi32(0xc2b2ae35));
+        h = _mm_xor_si128(h, _mm_srli_epi32(h, 16));
+
+        _mm_storeu_si128((__m128i *)k, h);
+        for (j = 0; j < 4 && base + j < nseeds; j++)
+            out[base + j] = k[j];
+    }
+}
+
+__attribute__((target("avx2")))
+static inline __m256i rotl_avx2(__m256i x, int r)
+{
+    return _mm256_or_si256(_mm256_slli_epi32(x, r), _mm256_srli_epi32(x, 32 - r));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i step_avx2(__m256i h, uint32_t k1)
+{
+    h = rotl_avx2(_mm256_xor_si256(h, _mm256_set1_epi32(k1)), 13);
+    return _mm256_add_epi32(_mm256_add_epi32(h, _mm256_slli_epi32(h, 2)),
+                            _mm256_set1_epi32(0xe6546b64));
+}
+
+__attribute__((target("avx2")))
+static void murmur_seeds_avx2(u32 *out, size_t nseeds, const u8 *data, size_t len)
+{
+    const size_t nblocks = len / 4;
+
+    for (size_t base = 0; base < nseeds; base += 8) {
+        __m256i h = _mm256_add_epi32(_mm256_set1_epi32(base),
+                                     _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        uint32_t k[8];
+        size_t i, j;
+
+        for (i = 0; i + 8 <= nblocks; i += 8) {
+            __m256i kv = _mm256_loadu_si256((const __m256i *)(data + i * 4));
+            kv = _mm256_mullo_epi32(kv, _mm256_set1_epi32(murmur_c1));
+            kv = rotl_avx2(kv, 15);
+            kv = _mm256_mullo_epi32(kv, _mm256_set1_epi32(murmur_c2));
+            _mm256_storeu_si256((__m256i *)k, kv);
+            for (j = 0; j < 8; j++)
+                h = step_avx2(h, k[j]);
+        }
+        for (; i < nblocks; i++) {
+            uint32_t k1;
+            memcpy(&k1, data + i * 4, 4);
+            k1 *= murmur_c1;
+            k1 = ROTL32(k1, 15);
+            k1 *= murmur_c2;
+            h = step_avx2(h, k1);
+        }
+        if (len & 3)
+            h = _mm256_xor_si256(h, _mm256_set1_epi32(murmur_tail(data + nblocks * 4, len & 3)));
+
+        h = _mm256_xor_si256(h, _mm256_set1_epi32(len));
+        h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+        h = _mm256_mullo_epi32(h, _mm256_set1_epi32(0x85ebca6b));
+        h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 13));
+        h = _mm256_mullo_epi32(h, _mm256_set1_epi32(0xc2b2ae35));
+        h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+
+        _mm256_storeu_si256((__m256i *)k, h);
+        for (j = 0; j < 8 && base + j < nseeds; j++)
+            out[base + j] = k[j];
+    }
+}
+#endif // HAVE_X86_KERNELS
+
+#ifdef HAVE_X86_KERNELS
+static bool have_avx2()
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+static bool have_sse41()
+{
+    return __builtin_cpu_supports("sse4.1");
+}
+#endif
+
+struct murmur_kernel {
+    const char *name;
+    void (*fn)(u32 *, size_t, const u8 *, size_t);
+    // NULL if any CPU runs it.
+    bool (*usable)();
+};
+
+// Best first.
+static const murmur_kernel kernels[] = {
+#ifdef HAVE_X86_KERNELS
+    { "avx2", murmur_seeds_avx2, have_avx2 },
+    { "sse4.1", murmur_seeds_sse41, have_sse41 },
+#endif
+    { "scalar", murmur_seeds_scalar, NULL }
+};
+
+static murmur_kernel pick_kernel()
+{
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+#endif
+    for (const auto &k: kernels) {
+        if (!k.usable || k.usable())
+            return k;
+    }
+    return kernels[0];
+}
+
+static const murmur_kernel &kernel()
+{
+    static const murmur_kernel k = pick_kernel();
+    return k;
+}
+
+void MurmurHash3_seeds(u32 *out, size_t nseeds, const u8 *data, size_t len)
+{
+    kernel().fn(out, nseeds, data, len);
+}
+
+const char *murmur_seeds_impl()
+{
+    return kernel().name;
+}
+
+const char *murmur_seeds_selftest(const u8 *data, size_t len, size_t nseeds)
+{
+    std::vector<u32> out(nseeds);
+
+    // Makes sure the CPU's been looked at.
+    kernel();
+    for (const auto &k: kernels) {
+        if (k.usable && !k.usable())
+            continue;
+        for (size_t l = 0; l <= len; l++) {
+            for (size_t n = 1; n <= nseeds; n++) {
+                k.fn(out.data(), n, data, l);
+                for (size_t i = 0; i < n; i++) {
+                    if (out[i] != MurmurHash3(i, data, l))
+                        return k.name;
+                }
+            }
+        }
+    }
+    return NULL;
+}
@@ -6,4 +6,16 @@ extern "C" {
 #include <cstring>
 
 u32 MurmurHash3(u32, const u8 *data, size_t len);
+
+// out[i] = MurmurHash3(i, data, len) for i < nseeds, with the seeds run
+// side by side in SIMD lanes over a single pass of the data.
+void MurmurHash3_seeds(u32 *out, size_t nseeds, const u8 *data, size_t len);
+
+// Name of the kernel MurmurHash3_seeds uses ("avx2", "sse4.1" or "scalar").
+const char *murmur_seeds_impl();
+
+// Every kernel this CPU runs, against MurmurHash3() for each length up
+// to len and each seed count up to nseeds: NULL if they all agree,
+// otherwise the name of the first which doesn't.
+const char *murmur_seeds_selftest(const u8 *data, size_t len, size_t nseeds);
 #endif // MURMUR_H
@@ -0,0 +1,127 @@
+#include "rateless.h"
+#include "murmur.h"
+#include "xorbytes.h"
+#include <algorithm>
+#include <cmath>
+
+void coded_symbol::apply(const txslice &s, u32 check, int dir)
+{
+    xor_bytes(sum.as_bytes(), s.as_bytes(), s.size());
+    checksum ^= check;
+    count += dir;
+}
+
+bool coded_symbol::pure() const
+{
+    if (count != 1 && count != -1)
+        return false;
+    return symbol_mapping(sum).check() == checksum;
+}
+
+bool coded_symbol::empty() const
+{
+    return count == 0 && checksum == 0 && sum.empty();
+}
+
+symbol_mapping::symbol_mapping(const txslice &s)
+    : idx(0)
+{
+    u32 h[2];
+
+    MurmurHash3_seeds(h, 2, s.as_bytes(), s.size());
+    prng = ((u64)h[1] << 32) | h[0];
+    check_val = h[0];
+}
+
+// Next index is a random jump, growing with the current one, such that
+// symbol i gets each slice with probability about 1/(1+i/2).
+void symbol_mapping::next()
+{
+    prng *= 0xda942042e4dd58b5ULL;
+    double jump = std::ceil((idx + 1.5) * (4294967296.0 / std::sqrt((double)prng + 1) - 1));
+
+    // Anything that far off we'll never get to.
+    if (jump >= (double)(1ULL << 62) || idx + (u64)jump < idx)
+        idx = (u64)-1;
+    else
+        idx += std::max(jump, 1.0);
+}
+
+void rateless_encoder::add(const txslice &s, int dir)
+{
+    item it(s, dir);
+
+    // It's only in symbols from now on.
+    while (it.map.index() < num)
+        it.map.next();
+    items.push_back(it);
+    heap.push_back(items.size() - 1);
+    std::push_heap(heap.begin(), heap.end(), [this](size_t a, size_t b) {
+            return items[a].map.index() > items[b].map.index();
+        });
+}
+
+void rateless_encoder::next(coded_symbol &c)
+{
+    auto later = [this](size_t a, size_t b) {
+        return items[a].map.index() > items[b].map.index();
+    };
+
+    while (!heap.empty() && items[heap.front()].map.index() == num) {
+        item &it = items[heap.front()];
+
+        c.apply(it.s, it.map.check(), it.dir);
+        std::pop_heap(heap.begin(), heap.end(), later);
+        it.map.next();
+        std::push_heap(heap.begin(), heap.end(), later);
+    }
+    num++;
+}
+
+bool rateless_decoder::add_symbol(const coded_symbol &c)
+{
+    coded_symbol diff(c);
+
+    // Take out ours, and what we've already peeled.
+    ours_enc.next(diff);
+    peeled_enc.next(diff);
+    symbols.push_back(diff);
+    if (diff.pure())
+        pure.push_back(symbols.size() - 1);
+
+    while (!pure.empty()) {
+        size_t n = pure.back();
+        pure.pop_back();
+        // May have changed since.
+        if (symbols[n].pure())
+            peel(n);
+    }
+    return decoded();
+}
+
+void rateless_decoder::peel(size_t n)
+{
+    txslice s = symbols[n].sum;
+    int dir = symbols[n].count;
+    symbol_mapping map(s);
+
+    if (dir == 1)
+        their_slices.push_back(s);
+    else
+        our_slices.push_back(s);
+
+    for (; map.index() < symbols.size(); map.next()) {
+        coded_symbol &c = symbols[map.index()];
+        c.apply(s, map.check(), -dir);
+        if (c.pure())
+            pure.push_back(map.index());
+    }
+
+    // And from every symbol to come.
+    peeled_enc.add(s, -dir);
+}
+
+bool rateless_decoder::decoded() const
+{
+    return !symbols.empty() && symbols[0].empty();
+}
@@ -0,0 +1,106 @@
+#ifndef RATELESS_H
+#define RATELESS_H
+// Rateless IBLT: instead of a table of fixed size, an endless stream of
+// coded symbols, each the sum of the slices mapped to it.  Every slice
+// is in symbol 0, and later symbols get sparser (about 1 in 1+i/2), so
+// any prefix of the stream peels like an IBLT, and the receiver just
+// stops the sender once it has decoded.
+//
+// From: Lei Yang, Yossi Gilad, Mohammad Alizadeh. "Practical Rateless Set
+// Reconciliation." ACM SIGCOMM 2024. https://arxiv.org/abs/2402.02668
+#include "txslice.h"
+#include <vector>
+
+struct coded_symbol {
+    txslice sum;
+    // XOR of the slices' check values: tells a pure symbol from a mix.
+    u32 checksum;
+    s16 count;
+
+    // Count, slice, checksum: what a symbol would cost to send.
+    static const size_t WIRE_BYTES = 2 + 8 + IBLT_SIZE + 4;
+
+    coded_symbol() : checksum(0), count(0) { memset(&sum, 0, sizeof(sum)); }
+
+    // Add (dir = 1) or remove (dir = -1) a slice.
+    void apply(const txslice &s, u32 check, int dir);
+
+    // Exactly one slice (count says which way)?
+    bool pure() const;
+    bool empty() const;
+};
+
+// Which symbols a slice goes in: 0, then ever sparser.
+class symbol_mapping {
+public:
+    explicit symbol_mapping(const txslice &s);
+
+    // The slice's check value, for coded_symbol::apply().
+    u32 check() const { return check_val; }
+
+    // Current symbol index, and move to the next one.
+    u64 index() const { return idx; }
+    void next();
+
+private:
+    u64 prng, idx;
+    u32 check_val;
+};
+
+// Makes coded symbols 0, 1, 2... from a set of slices.
+class rateless_encoder {
+public:
+    rateless_encoder() : num(0) { }
+
+    // Add a slice (dir = -1 to subtract it) from the next symbol on.
+    void add(const txslice &s, int dir = 1);
+
+    // Add this encoder's part of the next symbol to c.
+    void next(coded_symbol &c);
+    coded_symbol next() { coded_symbol c; next(c); return c; }
+
+    // How many symbols so far.
+    size_t produced() const { return num; }
+
+private:
+    struct item {
+        txslice s;
+        symbol_mapping map;
+        int dir;
+
+        item(const txslice &slice, int d) : s(slice), map(slice), dir(d) { }
+    };
+    std::vector<item> items;
+    // Min-heap of items on map.index().
+    std::vector<size_t> heap;
+    size_t num;
+};
+
+// Takes their symbols in order, and peels the difference as it goes.
+class rateless_decoder {
+public:
+    // Our slices: must all be added before the first symbol.
+    void add_ours(const txslice &s) { ours_enc.add(s, -1); }
+
+    // Their next symbol: returns true if that's decoded everything.
+    bool add_symbol(const coded_symbol &c);
+
+    // Everything peeled, and nothing left?
+    bool decoded() const;
+
+    size_t received() const { return symbols.size(); }
+
+    // Slices only they have, and only we have, so far.
+    const std::vector<txslice> &theirs() const { return their_slices; }
+    const std::vector<txslice> &ours() const { return our_slices; }
+
+private:
+    // Take a pure symbol's slice out everywhere it's mapped.
+    void peel(size_t n);
+
+    rateless_encoder ours_enc, peeled_enc;
+    std::vector<coded_symbol> symbols;
+    std::vector<size_t> pure;
+    std::vector<txslice> their_slices, our_slices;
+};
+#endif // RATELESS_H
@@ -1,48 +1,372 @@
 #include "rawiblt.h"
 #include "tx.h"
+#include "xorbytes.h"
+#include "murmur.h"
 #include <stdexcept>
+#include <string>
 #include <algorithm>
+#include <thread>
 
-/*  "We will show that hash_count values of 3 or 4 work well in practice"
+#ifdef IBLT_SOA
+void raw_iblt::frob_bucket(size_t n, const txslice &s, u16 check, int dir)
+{
+    counts[n] += dir;
+    if (!checks.empty())
+        checks[n] ^= check;
+    txids[n] ^= s.txidbits;
+    fragids[n] ^= s.fragid;
+    xor_bytes(&contents[n * IBLT_SIZE], s.contents, IBLT_SIZE);
+}
+
+txid48 raw_iblt::bucket_txid48(size_t n) const
+{
+    return txid48(txids[n]);
+}
 
-    From:
+u16 raw_iblt::bucket_fragid(size_t n) const
+{
+    return fragids[n];
+}
+
+txslice raw_iblt::bucket(size_t n) const
+{
+    txslice s;
 
-    Eppstein, David, et al. "What's the difference?: efficient set reconciliation without prior context." ACM SIGCOMM Computer Communication Review. Vol. 41. No. 4. ACM, 2011. http://conferences.sigcomm.org/sigcomm/2011/papers/sigcomm/p218.pdf
-*/
-/* Kalle Rosenbaum showed 3 was good enough. */
-#define NUM_HASHES 3
+    s.txidbits = txids[n];
+    s.fragid = fragids[n];
+    memcpy(s.contents, &contents[n * IBLT_SIZE], IBLT_SIZE);
+    return s;
+}
+
+void raw_iblt::prefetch_bucket(size_t n) const
+{
+    __builtin_prefetch(&counts[n], 1);
+    __builtin_prefetch(&txids[n], 1);
+    __builtin_prefetch(&fragids[n], 1);
+    __builtin_prefetch(&contents[n * IBLT_SIZE], 1);
+    if (!checks.empty())
+        __builtin_prefetch(&checks[n], 1);
+}
+
+bool raw_iblt::bucket_empty(size_t n) const
+{
+    return txids[n] == 0 && fragids[n] == 0
+        && bytes_zero(&contents[n * IBLT_SIZE], IBLT_SIZE)
+        && (checks.empty() || checks[n] == 0);
+}
+
+void raw_iblt::combine_range(size_t off, const raw_iblt &other,
+                             size_t other_off, size_t num, int dir)
+{
+    // Each array is one contiguous sweep.
+    xor_bytes((u8 *)&txids[off], (const u8 *)&other.txids[other_off],
+              num * sizeof(txids[0]));
+    xor_bytes((u8 *)&fragids[off], (const u8 *)&other.fragids[other_off],
+              num * sizeof(fragids[0]));
+    xor_bytes(&contents[off * IBLT_SIZE], &other.contents[other_off * IBLT_SIZE],
+              num * IBLT_SIZE);
+    for (size_t i = 0; i < num; i++)
+        counts[off + i] += dir * other.counts[other_off + i];
+    if (!checks.empty()) {
+        for (size_t i = 0; i < num; i++)
+            checks[off + i] ^= other.checks[other_off + i];
+    }
+}
+void raw_iblt::subtract_from(const raw_iblt_view &theirs)
+{
+    for (size_t i = 0; i < size(); i++) {
+        txslice s;
 
-void raw_iblt::frob_bucket(size_t n, const txslice &s, int dir)
+        memcpy(s.as_bytes(), theirs.bucket_bytes(i), s.size());
+        txids[i] ^= s.txidbits;
+        fragids[i] ^= s.fragid;
+        xor_bytes(&contents[i * IBLT_SIZE], s.contents, IBLT_SIZE);
+        counts[i] = theirs.count(i) - counts[i];
+    }
+    for (size_t i = 0; i < checks.size(); i++)
+        checks[i] ^= theirs.check(i);
+}
+#else
+void raw_iblt::frob_bucket(size_t n, const txslice &s, u16 check, int dir)
 {
     u8 *dest = buckets[n].as_bytes();
     const u8 *src = s.as_bytes();
 
     counts[n] += dir;
-    for (size_t i = 0; i < s.size(); i++)
-        dest[i] ^= src[i];
+    if (!checks.empty())
+        checks[n] ^= check;
+    xor_bytes(dest, src, s.size());
+}
+
+txid48 raw_iblt::bucket_txid48(size_t n) const
+{
+    return buckets[n].get_txid48();
+}
+
+u16 raw_iblt::bucket_fragid(size_t n) const
+{
+    return buckets[n].fragid;
+}
+
+txslice raw_iblt::bucket(size_t n) const
+{
+    return buckets[n];
+}
+
+void raw_iblt::prefetch_bucket(size_t n) const
+{
+    // A 72-byte bucket can straddle two cachelines.
+    const u8 *p = buckets[n].as_bytes();
+    __builtin_prefetch(&counts[n], 1);
+    __builtin_prefetch(p, 1);
+    __builtin_prefetch(p + txslice::size() - 1, 1);
+    if (!checks.empty())
+        __builtin_prefetch(&checks[n], 1);
+}
+
+bool raw_iblt::bucket_empty(size_t n) const
+{
+    return buckets[n].empty() && (checks.empty() || checks[n] == 0);
+}
+
+void raw_iblt::combine_range(size_t off, const raw_iblt &other,
+                             size_t other_off, size_t num, int dir)
+{
+    // FIXME: txslice as union!
+    xor_bytes((u8 *)&buckets[off], (const u8 *)&other.buckets[other_off],
+              num * sizeof(buckets[0]));
+    for (size_t i = 0; i < num; i++)
+        counts[off + i] += dir * other.counts[other_off + i];
+    if (!checks.empty()) {
+        for (size_t i = 0; i < num; i++)
+            checks[off + i] ^= other.checks[other_off + i];
+    }
+}
+
+void raw_iblt::subtract_from(const raw_iblt_view &theirs)
+{
+    // Wire layout is the same as ours, so this is one sweep.
+    xor_bytes((u8 *)buckets.data(), theirs.bucket_bytes(0),
+              buckets.size() * sizeof(buckets[0]));
+    for (size_t i = 0; i < size(); i++)
+        counts[i] = theirs.count(i) - counts[i];
+    for (size_t i = 0; i < checks.size(); i++)
+        checks[i] ^= theirs.check(i);
+}
+#endif // !IBLT_SOA
+
+std::array<size_t, raw_iblt::NUM_HASHES> raw_iblt::select_buckets(const txslice &s) const
+{
+    std::array<size_t, NUM_HASHES> buckets;
+
+    select_buckets(s, buckets.data());
+    return buckets;
+}
+
+// MurmurHash3's 64-bit finalizer.
+static u64 mix64(u64 k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+// Map h onto [0, n) without a divide: the high half of h * n.
+static size_t fastrange(u32 h, size_t n)
+{
+    return ((u64)h * n) >> 32;
 }
 
-// FIXME: Use std::array
-std::vector<size_t> raw_iblt::select_buckets(const txslice &s)
+void raw_iblt::select_buckets(const txslice &s, size_t pos[NUM_HASHES]) const
 {
-	std::vector<size_t> buckets(NUM_HASHES);
-	
-	for (size_t i = 0; i < buckets.size(); i++) {
+    u32 h[NUM_HASHES];
+
+    if (iblt_flags & KEY_HASH) {
+        // txid48 is already seeded and random, and with the fragid it's
+        // unique per slice: mix it into independent hashes.  (Double
+        // hashing, a + i*b, lands all three in one bucket whenever b is
+        // 0 mod an odd size, and peels worse with subtables.)
+        u64 key = (u64)s.txidbits | ((u64)s.fragid << 48);
+        for (size_t i = 0; i < NUM_HASHES; i += 2) {
+            u64 k = mix64(key ^ (i * 0x9e3779b97f4a7c15ULL));
+            h[i] = k;
+            if (i + 1 < NUM_HASHES)
+                h[i + 1] = k >> 32;
+        }
+    } else {
+        // Same as MurmurHash3(i, ...) for each i, but in one pass.
+        MurmurHash3_seeds(h, NUM_HASHES, s.as_bytes(), s.size());
+    }
+
+    if (iblt_flags & SUBTABLES) {
+        // Any rounding goes in the last subtable, and tiny tables
+        // (subsize 0) just use the whole thing, like monte-carlo.
+        size_t subsize = size() / NUM_HASHES;
+        if (subsize == 0) {
+            for (size_t i = 0; i < NUM_HASHES; i++)
+                pos[i] = fastrange(h[i], size());
+            return;
+        }
+        for (size_t i = 0; i < NUM_HASHES - 1; i++)
+            pos[i] = subsize * i + fastrange(h[i], subsize);
+        pos[NUM_HASHES - 1] = subsize * (NUM_HASHES - 1)
+            + fastrange(h[NUM_HASHES - 1], size() - subsize * (NUM_HASHES - 1));
+        return;
+    }
+
+    for (size_t i = 0; i < NUM_HASHES; i++) {
         // FIXME: Can skip divide if we force buckets to power of 2.
-        buckets[i] = MurmurHash3(i, s.as_bytes(), s.size()) % size();
+        pos[i] = h[i] % size();
     }
+}
 
-	return buckets;
+// A seed the bucket hashes don't use: the txid48 in the slice is
+// already keyed by the block's seed, so this is too.
+u16 raw_iblt::slice_check(const txslice &s) const
+{
+    if (checks.empty())
+        return 0;
+    return MurmurHash3(NUM_HASHES, s.as_bytes(), s.size());
 }
 
 void raw_iblt::frob_buckets(const txslice &s, int dir)
 {
-    std::vector<size_t> buckets = select_buckets(s);
+    std::array<size_t, NUM_HASHES> buckets = select_buckets(s);
+    u16 check = slice_check(s);
     for (size_t i = 0; i < buckets.size(); i++) {
-        frob_bucket(buckets[i], s, dir);
+        frob_bucket(buckets[i], s, check, dir);
     }
 }
 
+void raw_iblt::frob_slice(const size_t *pos, const txslice &s, int dir)
+{
+    u16 check = slice_check(s);
+    for (size_t i = 0; i < NUM_HASHES; i++)
+        frob_bucket(pos[i], s, check, dir);
+}
+
+void raw_iblt::frob_batch(const txslice *s, size_t num, int dir)
+{
+    for_each_batch(s, num, [this, dir](const size_t *pos, const txslice &slice) {
+            frob_slice(pos, slice, dir);
+        });
+}
+
+void raw_iblt::frob_tx(const tx &t, const txid48 &id, int dir)
+{
+    slice_iter it(t, id);
+
+    for_each_stream([&it](txslice &s) { return it.next(s); },
+                    [this, dir](const size_t *pos, const txslice &s) {
+            frob_slice(pos, s, dir);
+        });
+}
+
+void raw_iblt::insert_tx(const tx &t, const txid48 &id)
+{
+    frob_tx(t, id, 1);
+}
+
+void raw_iblt::remove_tx(const tx &t, const txid48 &id)
+{
+    frob_tx(t, id, -1);
+}
+
+void raw_iblt::insert_batch(const txslice *s, size_t num)
+{
+    frob_batch(s, num, 1);
+}
+
+void raw_iblt::remove_batch(const txslice *s, size_t num)
+{
+    frob_batch(s, num, -1);
+}
+
+void raw_iblt::subtract(const raw_iblt &other)
+{
+    combine_range(0, other, 0, size(), -1);
+}
+
+void raw_iblt::merge(const raw_iblt &other)
+{
+    combine_range(0, other, 0, size(), 1);
+}
+
+void raw_iblt::check_foldable(const char *what) const
+{
+    if (size() % 2)
+        throw std::logic_error(std::string("Cannot ") + what + " odd-sized IBLT");
+    if ((iblt_flags & SUBTABLES) && size() % (2 * NUM_HASHES))
+        throw std::logic_error(std::string("Cannot ") + what + " uneven IBLT subtables");
+}
+
+// Bucket positions are hash % size, and (h % 2n) % n == h % n, so
+// folding gives exactly the IBLT we would have built at size n.
+// With SUBTABLES, positions are (h * sub) >> 32 within each subtable, and
+// halving sub halves that (rounding down): buckets 2n and 2n+1 become n.
+raw_iblt raw_iblt::fold() const
+{
+    size_t half = size() / 2;
+
+    check_foldable("fold");
+
+    raw_iblt folded(half, iblt_flags);
+    if (iblt_flags & SUBTABLES) {
+        for (size_t i = 0; i < half; i++) {
+            folded.combine_range(i, *this, 2 * i, 1, 1);
+            folded.combine_range(i, *this, 2 * i + 1, 1, 1);
+        }
+    } else {
+        folded.combine_range(0, *this, 0, half, 1);
+        folded.combine_range(0, *this, half, half, 1);
+    }
+    return folded;
+}
+
+raw_iblt raw_iblt::upper_half() const
+{
+    size_t half = size() / 2;
+
+    check_foldable("split");
+
+    // For SUBTABLES, the "upper half" is the odd buckets.
+    raw_iblt upper(half, iblt_flags);
+    if (iblt_flags & SUBTABLES) {
+        for (size_t i = 0; i < half; i++)
+            upper.combine_range(i, *this, 2 * i + 1, 1, 1);
+    } else {
+        upper.combine_range(0, *this, half, half, 1);
+    }
+    return upper;
+}
+
+raw_iblt raw_iblt::unfold(const raw_iblt &upper) const
+{
+    if (upper.size() != size())
+        throw std::runtime_error("IBLT halves not same size");
+    if (upper.flags() != flags())
+        throw std::runtime_error("IBLT halves not same flags");
+
+    // Lower half is what we have, minus the upper half folded into it.
+    raw_iblt whole(size() * 2, iblt_flags);
+    whole.check_foldable("unfold into");
+    if (iblt_flags & SUBTABLES) {
+        for (size_t i = 0; i < size(); i++) {
+            whole.combine_range(2 * i, *this, i, 1, 1);
+            whole.combine_range(2 * i, upper, i, 1, -1);
+            whole.combine_range(2 * i + 1, upper, i, 1, 1);
+        }
+    } else {
+        whole.combine_range(0, *this, 0, size(), 1);
+        whole.combine_range(0, upper, 0, size(), -1);
+        whole.combine_range(size(), upper, 0, size(), 1);
+    }
+    return whole;
+}
+
 void raw_iblt::insert(const txslice &s)
 {
     frob_buckets(s, 1);
@@ -55,61 +379,176 @@ void raw_iblt::remove(const txslice &s)
 
 size_t raw_iblt::size() const
 {
-    return buckets.size();
+    return counts.size();
+}
+
+#ifdef IBLT_SOA
+#define BUCKET_STORAGE(size, flags) \
+    txids(size), fragids(size), contents((size) * IBLT_SIZE), counts(size), \
+    checks((flags) & HASH_CHECK ? (size) : 0), iblt_flags(flags)
+#else
+#define BUCKET_STORAGE(size, flags) \
+    buckets(size), counts(size), checks((flags) & HASH_CHECK ? (size) : 0), \
+    iblt_flags(flags)
+#endif
+
+raw_iblt::raw_iblt(size_t size, unsigned int flags)
+    : BUCKET_STORAGE(size, flags)
+{
 }
-    
-raw_iblt::raw_iblt(size_t size)
-    : buckets(size), counts(size)
+
+void raw_iblt::reset(size_t size, unsigned int flags)
+{
+#ifdef IBLT_SOA
+    txids.assign(size, 0);
+    fragids.assign(size, 0);
+    contents.assign(size * IBLT_SIZE, 0);
+#else
+    buckets.resize(size);
+    memset(buckets.data(), 0, size * sizeof(buckets[0]));
+#endif
+    counts.assign(size, 0);
+    checks.assign(flags & HASH_CHECK ? size : 0, 0);
+    iblt_flags = flags;
+}
+
+raw_iblt::raw_iblt(const raw_iblt_view &view)
+    : BUCKET_STORAGE(view.size(), view.flags())
 {
+    subtract_from(view);
 }
 
 raw_iblt::raw_iblt(size_t size, u64 seed,
-						  const std::unordered_set<const tx *> &txs)
-    : buckets(size), counts(size)
+                   const std::unordered_set<const tx *> &txs,
+                   unsigned int nthreads, unsigned int flags)
+    : BUCKET_STORAGE(size, flags)
 {
-    for (const auto &t : txs) {
-        for (const auto &s : slice_tx(*t->btx, txid48(seed, t->btx->txid()))) {
-            insert(s);
-        }
-    }
+    build(seed, std::vector<const tx *>(txs.begin(), txs.end()), nthreads);
 }
 
 raw_iblt::raw_iblt(size_t size, u64 seed,
-                   const txmap &txs)
-    : buckets(size), counts(size)
+                   const txmap &txs, unsigned int nthreads,
+                   unsigned int flags)
+    : BUCKET_STORAGE(size, flags)
 {
+    std::vector<const tx *> vec;
+
+    vec.reserve(txs.size());
     for (const auto &t : txs) {
-        for (const auto &s : slice_tx(*t.second->btx, txid48(seed, t.first))) {
-            insert(s);
-        }
+        vec.push_back(t.second);
     }
+    build(seed, vec, nthreads);
+}
+
+void raw_iblt::insert_txs(u64 seed, const tx *const *txs, size_t num)
+{
+    slice_iter it;
+    size_t i = 0;
+    // Their txid48s, a batch at a time (16 fills an AVX-512 kernel).
+    static const size_t TXID48_BATCH = 16;
+    const bitcoin_txid *txids[TXID48_BATCH];
+    u64 ids[TXID48_BATCH];
+
+    // One tx's slices after another, straight into the buckets.
+    for_each_stream([&](txslice &s) {
+            while (!it.next(s)) {
+                if (i == num)
+                    return false;
+                if (i % TXID48_BATCH == 0) {
+                    size_t n = std::min(num - i, TXID48_BATCH);
+                    for (size_t j = 0; j < n; j++)
+                        txids[j] = &txs[i + j]->txid;
+                    txid48_batch(seed, txids, n, ids);
+                }
+                it = slice_iter(*txs[i], txid48(ids[i % TXID48_BATCH]));
+                i++;
+            }
+            return true;
+        }, [this](const size_t *pos, const txslice &s) {
+            frob_slice(pos, s, 1);
+        });
 }
 
+void raw_iblt::build(u64 seed, const std::vector<const tx *> &txs,
+                     unsigned int nthreads)
+{
+    // Not worth a thread unless it gets a decent shard.
+    nthreads = std::max(1U, std::min<unsigned int>(nthreads, txs.size() / 64));
+    if (nthreads == 1) {
+        insert_txs(seed, txs.data(), txs.size());
+        return;
+    }
+
+    // Insertion is linear, so each thread fills its own table from a
+    // disjoint shard, and we XOR them together: same result as serial.
+    std::vector<raw_iblt> partial(nthreads - 1, raw_iblt(size(), iblt_flags));
+    std::vector<std::thread> threads;
+    size_t shard = (txs.size() + nthreads - 1) / nthreads;
+
+    for (unsigned int i = 1; i < nthreads; i++) {
+        size_t start = std::min(txs.size(), i * shard);
+        size_t end = std::min(txs.size(), start + shard);
+        raw_iblt *p = &partial[i - 1];
+        threads.push_back(std::thread([p, seed, &txs, start, end]() {
+                    p->insert_txs(seed, txs.data() + start, end - start);
+                }));
+    }
+
+    // We do the first shard ourselves.
+    insert_txs(seed, txs.data(), std::min(txs.size(), shard));
+
+    for (unsigned int i = 1; i < nthreads; i++) {
+        threads[i - 1].join();
+        merge(partial[i - 1]);
+    }
+}
+
+// Counts, buckets, then any checks.
 std::vector<u8> raw_iblt::write() const
 {
-    size_t buckets_len = size() * buckets[0].size(), counts_len = size() * sizeof(counts[0]);
-    std::vector<u8> vec(counts_len + buckets_len);
+    size_t buckets_len = size() * txslice::size(), counts_len = size() * sizeof(counts[0]);
+    size_t checks_len = checks.size() * sizeof(checks[0]);
+    std::vector<u8> vec(counts_len + buckets_len + checks_len);
 
     // The joys of plain ol' data.
     memcpy(vec.data(), counts.data(), counts_len);
-    for (size_t i = 0; i < size(); i++)
-        memcpy(vec.data() + counts_len + i * buckets[i].size(),
-               buckets[i].as_bytes(), buckets[i].size());
+    for (size_t i = 0; i < size(); i++) {
+        txslice s = bucket(i);
+        memcpy(vec.data() + counts_len + i * s.size(), s.as_bytes(), s.size());
+    }
+    memcpy(vec.data() + counts_len + buckets_len, checks.data(), checks_len);
     return vec;
 }
 
-        
 bool raw_iblt::read(const u8 *p, size_t len)
 {
-    size_t buckets_len = size() * buckets[0].size(), counts_len = size() * sizeof(counts[0]);
-    if (len != counts_len + buckets_len)
+    size_t buckets_len = size() * txslice::size(), counts_len = size() * sizeof(counts[0]);
+    size_t checks_len = checks.size() * sizeof(checks[0]);
+    if (len != counts_len + buckets_len + checks_len)
         return false;
 
     memcpy(counts.data(), p, counts_len);
-    for (size_t i = 0; i < size(); i++)
-        memcpy(buckets[i].as_bytes(),
-               p + counts_len + i * buckets[i].size(),
-               buckets[i].size());
+    for (size_t i = 0; i < size(); i++) {
+        const u8 *src = p + counts_len + i * txslice::size();
+#ifdef IBLT_SOA
+        txslice s;
+        memcpy(s.as_bytes(), src, s.size());
+        txids[i] = s.txidbits;
+        fragids[i] = s.fragid;
+        memcpy(&contents[i * IBLT_SIZE], s.contents, IBLT_SIZE);
+#else
+        memcpy(buckets[i].as_bytes(), src, buckets[i].size());
+#endif
+    }
+    memcpy(checks.data(), p + counts_len + buckets_len, checks_len);
     return true;
 }
 
+bool raw_iblt_view::read(const u8 *buf, size_t len)
+{
+    size_t checks_len = (iblt_flags & raw_iblt::HASH_CHECK) ? num * sizeof(u16) : 0;
+    if (len != num * (sizeof(s16) + txslice::size()) + checks_len)
+        return false;
+    p = buf;
+    return true;
+}
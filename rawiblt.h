@@ -4,51 +4,255 @@
 #include "txid48.h"
 #include "txslice.h"
 #include "io.h"
+#include "aligned.h"
 #include <vector>
+#include <array>
 #include <set>
 #include <unordered_set>
 
 class tx;
 
+// Read-only IBLT pointing straight into a wire buffer (as produced by
+// raw_iblt::write()).  The buffer must outlive the view.
+class raw_iblt_view {
+public:
+    raw_iblt_view(size_t size, unsigned int flags = 0)
+        : num(size), iblt_flags(flags), p(NULL) { }
+
+    // Point at this buffer: fails if it's not exactly the right length.
+    bool read(const u8 *buf, size_t len);
+
+    size_t size() const { return num; }
+    unsigned int flags() const { return iblt_flags; }
+    s16 count(size_t n) const {
+        s16 c;
+        memcpy(&c, p + n * sizeof(c), sizeof(c));
+        return c;
+    }
+    // The packed txslice bytes of this bucket (may be unaligned!)
+    const u8 *bucket_bytes(size_t n) const {
+        return p + num * sizeof(s16) + n * txslice::size();
+    }
+    // Its check (raw_iblt::HASH_CHECK only).
+    u16 check(size_t n) const {
+        u16 c;
+        memcpy(&c, p + num * (sizeof(s16) + txslice::size()) + n * sizeof(c), sizeof(c));
+        return c;
+    }
+
+private:
+    size_t num;
+    unsigned int iblt_flags;
+    const u8 *p;
+};
+
 // Raw IBLT for handing over the wire.
 class raw_iblt {
 public:
+    // Flags which change how the IBLT is built: these go on the wire
+    // with the size (see add_iblt_size()), so different kinds never mix.
+
+    // Bucket positions come from (txid48, fragid), not the whole slice.
+    static const unsigned int KEY_HASH = 1;
+    // Each hash gets its own subtable (as utils/monte-carlo --sub-tables),
+    // indexed by multiply-shift rather than modulo.  Folding then pairs
+    // adjacent buckets, and needs size() to be a multiple of 2*NUM_HASHES.
+    static const unsigned int SUBTABLES = 2;
+    // Each bucket also has the XOR of its slices' 16-bit checks (see
+    // slice_check()), so a count +/-1 bucket which is really a mix can
+    // be skipped rather than peeled.
+    static const unsigned int HASH_CHECK = 4;
+    static const unsigned int KNOWN_FLAGS = KEY_HASH | SUBTABLES | HASH_CHECK;
+
     // Empty IBLT
-    raw_iblt(size_t size);
-    // Construct an IBLT from a series of transactions.
-    raw_iblt(size_t size, u64 seed, const std::unordered_set<const tx *> &txs);
-    raw_iblt(size_t size, u64 seed, const txmap &txs);
+    raw_iblt(size_t size, unsigned int flags = 0);
+    // Copy of a wire IBLT.
+    explicit raw_iblt(const raw_iblt_view &view);
+    // Construct an IBLT from a series of transactions, using up to
+    // nthreads threads (the result is identical however many).
+    raw_iblt(size_t size, u64 seed, const std::unordered_set<const tx *> &txs,
+             unsigned int nthreads = 1, unsigned int flags = 0);
+    raw_iblt(size_t size, u64 seed, const txmap &txs,
+             unsigned int nthreads = 1, unsigned int flags = 0);
+
+    // Empty it at this size and flags, reusing the storage it has.
+    void reset(size_t size, unsigned int flags = 0);
+
+    // Slice and insert these txs, using up to nthreads threads.
+    void build(u64 seed, const std::vector<const tx *> &txs,
+               unsigned int nthreads = 1);
 
     // Get size arg as passed to constructor.
     size_t size() const;
 
+    // Get flags arg as passed to constructor.
+    unsigned int flags() const { return iblt_flags; }
+
+    // Per-bucket accessors, whatever the storage layout.
+    s16 count(size_t n) const { return counts[n]; }
+    txid48 bucket_txid48(size_t n) const;
+    u16 bucket_fragid(size_t n) const;
+    txslice bucket(size_t n) const;
+    bool bucket_empty(size_t n) const;
+
+    // This slice's check: 0 unless HASH_CHECK.
+    u16 slice_check(const txslice &s) const;
+    // Could this bucket hold just one slice?  Always true unless
+    // HASH_CHECK, where its check must match its contents.
+    bool bucket_check_ok(size_t n) const {
+        return checks.empty() || slice_check(bucket(n)) == checks[n];
+    }
+
+    // this -= other (XOR buckets, subtract counts).  Same size only!
+    void subtract(const raw_iblt &other);
+    // this += other (XOR buckets, add counts).  Same size only!
+    void merge(const raw_iblt &other);
+    // this = theirs - this, in place.  Same size only!
+    void subtract_from(const raw_iblt_view &theirs);
+
+    // Fold an even-sized IBLT in half (XOR the two halves together, or
+    // adjacent pairs for SUBTABLES).
+    // This is the same IBLT as building from scratch at size() / 2.
+    raw_iblt fold() const;
+
+    // What the receiver of fold() needs to get back to this IBLT.
+    raw_iblt upper_half() const;
+
+    // Undo fold(), given the upper_half() of the original.
+    raw_iblt unfold(const raw_iblt &upper) const;
+
     // Linearize this iblt.
     std::vector<u8> write() const;
 
     // De-linearize this iblt.
     bool read(const u8 *p, size_t len);
 
+    // Insert or remove many slices at once: hashes a window of slices
+    // ahead and prefetches their buckets before touching them.
+    void insert_batch(const txslice *s, size_t num);
+    void remove_batch(const txslice *s, size_t num);
+    void insert_batch(const std::vector<txslice> &v) { insert_batch(v.data(), v.size()); }
+    void remove_batch(const std::vector<txslice> &v) { remove_batch(v.data(), v.size()); }
+
+    // Slice and insert or remove a single tx, without keeping its slices.
+    void insert_tx(const tx &t, const txid48 &id);
+    void remove_tx(const tx &t, const txid48 &id);
+
+    /*  "We will show that hash_count values of 3 or 4 work well in practice"
+
+        From:
+
+        Eppstein, David, et al. "What's the difference?: efficient set reconciliation without prior context." ACM SIGCOMM Computer Communication Review. Vol. 41. No. 4. ACM, 2011. http://conferences.sigcomm.org/sigcomm/2011/papers/sigcomm/p218.pdf
+    */
+    /* Kalle Rosenbaum showed 3 was good enough. */
+    static const size_t NUM_HASHES = 3;
+
+    // How many slices ahead the batch functions hash and prefetch.
+    static const size_t PREFETCH_AHEAD = 8;
+
     // Overhead on the wire for each bucket (6 txid48, 2 fragid, 2 counter)
     static const std::size_t OVERHEAD = 6 + 2 + 2;
     static const std::size_t WIRE_BYTES = IBLT_SIZE + OVERHEAD;
+    // And with HASH_CHECK, per bucket.
+    static const std::size_t CHECK_BYTES = 2;
 
 private:
     friend class iblt;
 
-    // Put slice into a single bucket (or remove, if dir = -1)
-    void frob_bucket(size_t bucket, const txslice &s, int dir);
+    // Put slice into a single bucket (or remove, if dir = -1); check is
+    // its slice_check().
+    void frob_bucket(size_t bucket, const txslice &s, u16 check, int dir);
+
+    // Throws unless fold() could be applied.
+    void check_foldable(const char *what) const;
 
     // Put slice into all its buckets (or remove, if dir = -1)
     void frob_buckets(const txslice &s, int dir);
 
     // For iblt to open-code frob_bucket() calls
-    std::vector<size_t> select_buckets(const txslice &s);
+    std::array<size_t, NUM_HASHES> select_buckets(const txslice &s) const;
+    void select_buckets(const txslice &s, size_t pos[NUM_HASHES]) const;
+
+    // Hint that we're about to frob this bucket.
+    void prefetch_bucket(size_t n) const;
+
+    // Calls apply(pos, s[i]) for each slice, with its buckets prefetched.
+    template <typename F>
+    void for_each_batch(const txslice *s, size_t num, F apply) const {
+        size_t pos[PREFETCH_AHEAD][NUM_HASHES];
+        size_t i, h;
+
+        for (i = 0; i < num && i < PREFETCH_AHEAD; i++) {
+            select_buckets(s[i], pos[i]);
+            for (h = 0; h < NUM_HASHES; h++)
+                prefetch_bucket(pos[i][h]);
+        }
+        for (i = 0; i < num; i++) {
+            size_t *p = pos[i % PREFETCH_AHEAD];
+            apply(p, s[i]);
+            // Reuse this slot for the one PREFETCH_AHEAD later.
+            if (i + PREFETCH_AHEAD < num) {
+                select_buckets(s[i + PREFETCH_AHEAD], p);
+                for (h = 0; h < NUM_HASHES; h++)
+                    prefetch_bucket(p[h]);
+            }
+        }
+    }
+
+    // Same, but slices come from next(slice) until it returns false,
+    // each hashed and applied from a ring of PREFETCH_AHEAD: however
+    // many there are, that's all we hold.
+    template <typename G, typename F>
+    void for_each_stream(G next, F apply) const {
+        txslice ring[PREFETCH_AHEAD];
+        size_t pos[PREFETCH_AHEAD][NUM_HASHES];
+        size_t in = 0, out = 0, h;
+
+        for (;;) {
+            // Fill the ring, then it's one in for each one out.
+            if (in - out < PREFETCH_AHEAD && next(ring[in % PREFETCH_AHEAD])) {
+                size_t *p = pos[in % PREFETCH_AHEAD];
+                select_buckets(ring[in % PREFETCH_AHEAD], p);
+                for (h = 0; h < NUM_HASHES; h++)
+                    prefetch_bucket(p[h]);
+                in++;
+            } else if (out < in) {
+                apply(pos[out % PREFETCH_AHEAD], ring[out % PREFETCH_AHEAD]);
+                out++;
+            } else
+                break;
+        }
+    }
+
+    // Apply one slice to the buckets pos (from select_buckets()).
+    void frob_slice(const size_t *pos, const txslice &s, int dir);
+    void frob_batch(const txslice *s, size_t num, int dir);
+    void frob_tx(const tx &t, const txid48 &id, int dir);
+
+    // XOR num of other's buckets (from other_off) into ours (from off),
+    // adding dir * its counts.
+    void combine_range(size_t off, const raw_iblt &other,
+                       size_t other_off, size_t num, int dir);
+
+    // Slice and insert these txs.
+    void insert_txs(u64 seed, const tx *const *txs, size_t num);
 
     // Convenience wrappers for above.
     void insert(const txslice &s);
     void remove(const txslice &s);
 
+#ifdef IBLT_SOA
+    // Structure-of-arrays: peeling mainly looks at counts, txids and
+    // fragids, so keep contents out of the way.
+    std::vector<u64, aligned_allocator<u64> > txids;
+    std::vector<u16, aligned_allocator<u16> > fragids;
+    std::vector<u8, aligned_allocator<u8> > contents;
+#else
     std::vector<txslice> buckets;
+#endif
     std::vector<s16> counts;
+    // One per bucket with HASH_CHECK, otherwise empty.
+    std::vector<u16> checks;
+    unsigned int iblt_flags;
 };
 #endif // RAWIBLT_H
@@ -8,14 +8,20 @@ struct tx {
     u64 fee;
     struct bitcoin_txid txid;
     const bitcoin_tx *btx;
+    // btx serialized, once: slicing and length() just use this.
+    std::vector<u8> raw;
 
     tx(u64 bfee, const bitcoin_tx *txin)
-        : fee(bfee), txid(txin->txid()), btx(txin) { }
+        : fee(bfee), btx(txin), raw(txin->linearize()) {
+        txid.shad = sha256_double(raw.data(), raw.size());
+    }
+
+    size_t length() const { return raw.size(); }
 
     // Fee is actually capped at 2,100,000,000,000,000 satoshi.
     // 2^51 == 2,251,799,813,685,248, so we have 13 bits remaining.
     u64 satoshi_per_byte() const {
-        return fee << 13 / btx->length();
+        return fee << 13 / length();
     }
 };
 #endif // TX_H
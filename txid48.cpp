@@ -0,0 +1,389 @@
+#include "txid48.h"
+#include <algorithm>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+static void txid48_scalar(u64 seed, const bitcoin_txid *const *txids, size_t n,
+                          u64 *ids)
+{
+    for (size_t i = 0; i < n; i++)
+        ids[i] = txid48(seed, *txids[i]).get_id();
+}
+
+#ifdef HAVE_X86_KERNELS
+// txid || seed is 40 bytes, so SHA256 of it is a single padded block:
+// words 0-7 are the txid, 8-9 the seed, and 10-15 the same padding for
+// everyone.  Each lane runs one txid through the compression function.
+static const u32 sha256_iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const u32 sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+// Words 8-15 of the block: the seed as txid48 hashes it (le64), then the
+// padding for a 320-bit message.
+static void tail_words(u64 seed, u32 *w)
+{
+    le64 lseed = cpu_to_le64(seed);
+    u8 b[8];
+
+    memcpy(b, &lseed, sizeof(b));
+    w[0] = ((u32)b[0] << 24) | ((u32)b[1] << 16) | ((u32)b[2] << 8) | b[3];
+    w[1] = ((u32)b[4] << 24) | ((u32)b[5] << 16) | ((u32)b[6] << 8) | b[7];
+    w[2] = 0x80000000;
+    w[3] = w[4] = w[5] = w[6] = 0;
+    w[7] = 40 * 8;
+}
+
+// Words 0-7 of n txids, transposed so word j of lane l is w[j * lanes + l].
+// Spare lanes repeat the last txid.
+static void txid_words(const bitcoin_txid *const *txids, size_t n,
+                       size_t lanes, u32 *w)
+{
+    for (size_t l = 0; l < lanes; l++) {
+        const u8 *p = txids[std::min(l, n - 1)]->shad.sha.u.u8;
+        for (size_t j = 0; j < 8; j++) {
+            be32 word;
+            memcpy(&word, p + j * 4, sizeof(word));
+            w[j * lanes + l] = be32_to_cpu(word);
+        }
+    }
+}
+
+// The first 48 bits of the hash, as txid48 keeps them (little-endian).
+static u64 id_from_hash(u32 h0, u32 h1)
+{
+    return (u64)bswap_32(h0) | ((u64)(bswap_32(h1) & 0xFFFF) << 32);
+}
+
+__attribute__((target("sse2")))
+static inline __m128i rotr_sse2(__m128i x, int r)
+{
+    return _mm_or_si128(_mm_srli_epi32(x, r), _mm_slli_epi32(x, 32 - r));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i xor3_sse2(__m128i a, __m128i b, __m128i c)
+{
+    return _mm_xor_si128(_mm_xor_si128(a, b), c);
+}
+
+__attribute__((target("sse2")))
+static void txid48_sse2(u64 seed, const bitcoin_txid *const *txids, size_t n,
+                        u64 *ids)
+{
+    u32 tail[8];
+
+    tail_words(seed, tail);
+    for (size_t base = 0; base < n; base += 4) {
+        size_t num = std::min<size_t>(n - base, 4);
+        u32 words[8 * 4], h0[4], h1[4];
+        __m128i w[16], s[8];
+        size_t i;
+
+        txid_words(txids + base, num, 4, words);
+        for (i = 0; i < 8; i++) {
+            w[i] = _mm_loadu_si128((const __m128i *)(words + i * 4));
+            w[i + 8] = _mm_set1_epi32(tail[i]);
+            s[i] = _mm_set1_epi32(sha256_iv[i]);
+        }
+
+        for (i = 0; i < 64; i++) {
+            __m128i t1, t2;
+            if (i >= 16) {
+                __m128i w15 = w[(i - 15) & 15], w2 = w[(i - 2) & 15];
+                __m128i sig0 = xor3_sse2(rotr_sse2(w15, 7), rotr_sse2(w15, 18),
+                                         _mm_srli_epi32(w15, 3));
+                __m128i sig1 = xor3_sse2(rotr_sse2(w2, 17), rotr_sse2(w2, 19),
+                                         _mm_srli_epi32(w2, 10));
+                w[i & 15] = _mm_add_epi32(_mm_add_epi32(w[i & 15], sig0),
+                                          _mm_add_epi32(w[(i - 7) & 15], sig1));
+            }
+            // t1 = h + Σ1(e) + Ch(e,f,g) + k[i] + w[i]
+            t1 = _mm_add_epi32(s[7], xor3_sse2(rotr_sse2(s[4], 6),
+                                               rotr_sse2(s[4], 11),
+                                               rotr_sse2(s[4], 25)));
+            t1 = _mm_add_epi32(t1, _mm_xor_si128(_mm_and_si128(s[4], s[5]),
+                                                 _mm_andnot_si128(s[4], s[6])));
+            t1 = _mm_add_epi32(t1, _mm_add_epi32(_mm_set1_epi32(sha256_k[i]),
+                                                 w[i & 15]));
+            // t2 = Σ0(a) + Maj(a,b,c)
+            t2 = _mm_add_epi32(xor3_sse2(rotr_sse2(s[0], 2), rotr_sse2(s[0], 13),
+                                         rotr_sse2(s[0], 22)),
+                               _mm_or_si128(_mm_and_si128(s[0], s[1]),
+                                            _mm_and_si128(s[2],
+                                                          _mm_or_si128(s[0], s[1]))));
+            s[7] = s[6];
+            s[6] = s[5];
+            s[5] = s[4];
+            s[4] = _mm_add_epi32(s[3], t1);
+            s[3] = s[2];
+            s[2] = s[1];
+            s[1] = s[0];
+            s[0] = _mm_add_epi32(t1, t2);
+        }
+
+        _mm_storeu_si128((__m128i *)h0, _mm_add_epi32(s[0], _mm_set1_epi32(sha256_iv[0])));
+        _mm_storeu_si128((__m128i *)h1, _mm_add_epi32(s[1], _mm_set1_epi32(sha256_iv[1])));
+        for (i = 0; i < num; i++)
+            ids[base + i] = id_from_hash(h0[i], h1[i]);
+    }
+}
+
+__attribute__((target("avx2")))
+static inline __m256i rotr_avx2(__m256i x, int r)
+{
+    return _mm256_or_si256(_mm256_srli_epi32(x, r), _mm256_slli_epi32(x, 32 - r));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i xor3_avx2(__m256i a, __m256i b, __m256i c)
+{
+    return _mm256_xor_si256(_mm256_xor_si256(a, b), c);
+}
+
+__attribute__((target("avx2")))
+static void txid48_avx2(u64 seed, const bitcoin_txid *const *txids, size_t n,
+                        u64 *ids)
+{
+    u32 tail[8];
+
+    tail_words(seed, tail);
+    for (size_t base = 0; base < n; base += 8) {
+        size_t num = std::min<size_t>(n - base, 8);
+        u32 words[8 * 8], h0[8], h1[8];
+        __m256i w[16], s[8];
+        size_t i;
+
+        txid_words(txids + base, num, 8, words);
+        for (i = 0; i < 8; i++) {
+            w[i] = _mm256_loadu_si256((const __m256i *)(words + i * 8));
+            w[i + 8] = _mm256_set1_epi32(tail[i]);
+            s[i] = _mm256_set1_epi32(sha256_iv[i]);
+        }
+
+        for (i = 0; i < 64; i++) {
+            __m256i t1, t2;
+            if (i >= 16) {
+                __m256i w15 = w[(i - 15) & 15], w2 = w[(i - 2) & 15];
+                __m256i sig0 = xor3_avx2(rotr_avx2(w15, 7), rotr_avx2(w15, 18),
+                                         _mm256_srli_epi32(w15, 3));
+                __m256i sig1 = xor3_avx2(rotr_avx2(w2, 17), rotr_avx2(w2, 19),
+                                         _mm256_srli_epi32(w2, 10));
+                w[i & 15] = _mm256_add_epi32(_mm256_add_epi32(w[i & 15], sig0),
+                                             _mm256_add_epi32(w[(i - 7) & 15], sig1));
+            }
+            t1 = _mm256_add_epi32(s[7], xor3_avx2(rotr_avx2(s[4], 6),
+                                                  rotr_avx2(s[4], 11),
+                                                  rotr_avx2(s[4], 25)));
+            t1 = _mm256_add_epi32(t1, _mm256_xor_si256(_mm256_and_si256(s[4], s[5]),
+                                                       _mm256_andnot_si256(s[4], s[6])));
+            t1 = _mm256_add_epi32(t1, _mm256_add_epi32(_mm256_set1_epi32(sha256_k[i]),
+                                                       w[i & 15]));
+            t2 = _mm256_add_epi32(xor3_avx2(rotr_avx2(s[0], 2), rotr_avx2(s[0], 13),
+                                            rotr_avx2(s[0], 22)),
+                                  _mm256_or_si256(_mm256_and_si256(s[0], s[1]),
+                                                  _mm256_and_si256(s[2],
+                                                                   _mm256_or_si256(s[0], s[1]))));
+            s[7] = s[6];
+            s[6] = s[5];
+            s[5] = s[4];
+            s[4] = _mm256_add_epi32(s[3], t1);
+            s[3] = s[2];
+            s[2] = s[1];
+            s[1] = s[0];
+            s[0] = _mm256_add_epi32(t1, t2);
+        }
+
+        _mm256_storeu_si256((__m256i *)h0, _mm256_add_epi32(s[0], _mm256_set1_epi32(sha256_iv[0])));
+        _mm256_storeu_si256((__m256i *)h1, _mm256_add_epi32(s[1], _mm256_set1_epi32(sha256_iv[1])));
+        for (i = 0; i < num; i++)
+            ids[base + i] = id_from_hash(h0[i], h1[i]);
+    }
+}
+
+// AVX-512 has rotates, and one ternary-logic op does each 3-input
+// function: 0x96 is a^b^c, 0xCA is Ch and 0xE8 is Maj.  (Some GCCs
+// warn about the intrinsics' own _mm512_undefined_epi32()).
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f")))
+static void txid48_avx512(u64 seed, const bitcoin_txid *const *txids, size_t n,
+                          u64 *ids)
+{
+    u32 tail[8];
+
+    tail_words(seed, tail);
+    for (size_t base = 0; base < n; base += 16) {
+        size_t num = std::min<size_t>(n - base, 16);
+        u32 words[8 * 16], h0[16], h1[16];
+        __m512i w[16], s[8];
+        size_t i;
+
+        txid_words(txids + base, num, 16, words);
+        for (i = 0; i < 8; i++) {
+            w[i] = _mm512_loadu_si512((const void *)(words + i * 16));
+            w[i + 8] = _mm512_set1_epi32(tail[i]);
+            s[i] = _mm512_set1_epi32(sha256_iv[i]);
+        }
+
+        for (i = 0; i < 64; i++) {
+            __m512i t1, t2;
+            if (i >= 16) {
+                __m512i w15 = w[(i - 15) & 15], w2 = w[(i - 2) & 15];
+                __m512i sig0 = _mm512_ternarylogic_epi32(_mm512_ror_epi32(w15, 7),
+                                                         _mm512_ror_epi32(w15, 18),
+                                                         _mm512_srli_epi32(w15, 3), 0x96);
+                __m512i sig1 = _mm512_ternarylogic_epi32(_mm512_ror_epi32(w2, 17),
+                                                         _mm512_ror_epi32(w2, 19),
+                                                         _mm512_srli_epi32(w2, 10), 0x96);
+                w[i & 15] = _mm512_add_epi32(_mm512_add_epi32(w[i & 15], sig0),
+                                             _mm512_add_epi32(w[(i - 7) & 15], sig1));
+            }
+            t1 = _mm512_add_epi32(s[7],
+                                  _mm512_ternarylogic_epi32(_mm512_ror_epi32(s[4], 6),
+                                                            _mm512_ror_epi32(s[4], 11),
+                                                            _mm512_ror_epi32(s[4], 25), 0x96));
+            t1 = _mm512_add_epi32(t1, _mm512_ternarylogic_epi32(s[4], s[5], s[6], 0xCA));
+            t1 = _mm512_add_epi32(t1, _mm512_add_epi32(_mm512_set1_epi32(sha256_k[i]),
+                                                       w[i & 15]));
+            t2 = _mm512_add_epi32(_mm512_ternarylogic_epi32(_mm512_ror_epi32(s[0], 2),
+                                                            _mm512_ror_epi32(s[0], 13),
+                                                            _mm512_ror_epi32(s[0], 22), 0x96),
+                                  _mm512_ternarylogic_epi32(s[0], s[1], s[2], 0xE8));
+            s[7] = s[6];
+            s[6] = s[5];
+            s[5] = s[4];
+            s[4] = _mm512_add_epi32(s[3], t1);
+            s[3] = s[2];
+            s[2] = s[1];
+            s[1] = s[0];
+            s[0] = _mm512_add_epi32(t1, t2);
+        }
+
+        _mm512_storeu_si512((void *)h0, _mm512_add_epi32(s[0], _mm512_set1_epi32(sha256_iv[0])));
+        _mm512_storeu_si512((void *)h1, _mm512_add_epi32(s[1], _mm512_set1_epi32(sha256_iv[1])));
+        for (i = 0; i < num; i++)
+            ids[base + i] = id_from_hash(h0[i], h1[i]);
+    }
+}
+#pragma GCC diagnostic pop
+#endif // HAVE_X86_KERNELS
+
+#ifdef HAVE_X86_KERNELS
+static bool have_avx512()
+{
+    return __builtin_cpu_supports("avx512f");
+}
+
+static bool have_avx2()
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+static bool have_sse2()
+{
+    return __builtin_cpu_supports("sse2");
+}
+#endif
+
+struct txid48_kernel {
+    const char *name;
+    void (*fn)(u64, const bitcoin_txid *const *, size_t, u64 *);
+    // NULL if any CPU runs it.
+    bool (*usable)();
+};
+
+// Best first.
+static const txid48_kernel kernels[] = {
+#ifdef HAVE_X86_KERNELS
+    { "avx512", txid48_avx512, have_avx512 },
+    { "avx2", txid48_avx2, have_avx2 },
+    { "sse2", txid48_sse2, have_sse2 },
+#endif
+    { "scalar", txid48_scalar, NULL }
+};
+
+static txid48_kernel pick_kernel()
+{
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+#endif
+    for (const auto &k: kernels) {
+        if (k.usable && !k.usable())
+            continue;
+#ifdef HAVE_X86_KERNELS
+        // ccan's sha256 uses the SHA extensions then: faster than 4 lanes.
+        if (k.fn == txid48_sse2 && __builtin_cpu_supports("sha"))
+            continue;
+#endif
+        return k;
+    }
+    return kernels[0];
+}
+
+static const txid48_kernel &kernel()
+{
+    static const txid48_kernel k = pick_kernel();
+    return k;
+}
+
+void txid48_batch(u64 seed, const bitcoin_txid *const *txids, size_t n,
+                  u64 *ids)
+{
+    assert(seed);
+    kernel().fn(seed, txids, n, ids);
+}
+
+const char *txid48_batch_impl()
+{
+    return kernel().name;
+}
+
+const char *txid48_batch_selftest(u64 seed, const bitcoin_txid *const *txids,
+                                  size_t n)
+{
+    std::vector<u64> want(n), got(n);
+
+    for (size_t i = 0; i < n; i++)
+        want[i] = txid48(seed, *txids[i]).get_id();
+
+    // Makes sure the CPU's been looked at.
+    kernel();
+    for (const auto &k: kernels) {
+        if (k.usable && !k.usable())
+            continue;
+        // The whole lot, then short runs for each partial set of lanes.
+        k.fn(seed, txids, n, got.data());
+        if (got != want)
+            return k.name;
+        for (size_t m = 1; m < 17 && m <= n; m++) {
+            k.fn(seed, txids, m, got.data());
+            if (!std::equal(want.begin(), want.begin() + m, got.begin()))
+                return k.name;
+        }
+    }
+    return NULL;
+}
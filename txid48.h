@@ -69,6 +69,20 @@ public:
     }
 };
 
+// ids[i] = txid48(seed, *txids[i]).get_id() for i < n, but hashing a
+// vector of txids at once in SIMD lanes where the CPU can.
+void txid48_batch(u64 seed, const bitcoin_txid *const *txids, size_t n,
+                  u64 *ids);
+
+// Name of the kernel txid48_batch uses ("avx512", "avx2", "sse2" or "scalar").
+const char *txid48_batch_impl();
+
+// Every kernel this CPU runs, against txid48() on these txids (all n,
+// then each short run for partly filled lanes): NULL if they agree,
+// otherwise the name of the first which doesn't.
+const char *txid48_batch_selftest(u64 seed, const bitcoin_txid *const *txids,
+                                  size_t n);
+
 // To place them in unordered_set
 namespace std {
     template <>
@@ -1,5 +1,8 @@
 #include "txslice.h"
 #include "txid48.h"
+#include "tx.h"
+#include "xorbytes.h"
+#include <algorithm>
 
 
 struct slice_state {
@@ -27,15 +30,7 @@ static void add_slice(const void *data, size_t len, void *pvec)
 
 bool txslice::empty() const
 {
-    if (txidbits != 0 || fragid != 0) {
-        return false;
-    }
-    for (size_t i = 0; i < sizeof(contents); i++) {
-        if (contents[i]) {
-            return false;
-        }
-    }
-    return true;
+    return bytes_zero(as_bytes(), size());
 }
 
 // Size when varint_t is encoded at the front.
@@ -52,38 +47,131 @@ static size_t varint_len(varint_t v)
     }
 }
 
-std::vector<txslice> slice_tx(const bitcoin_tx &btx, const txid48 &id)
+// How many slices for a len-byte tx, with the count at the front.
+static varint_t slices_for_tx(size_t len)
 {
     // Optimistically assume we'll fit len in single byte.
-    varint_t n_slices = txslice::num_slices_for(1 + btx.length());
+    varint_t n_slices = txslice::num_slices_for(1 + len);
 
     // If it would take 3 bytes to encode we have to recalculate.
     if (varint_len(n_slices) > 1) {
             // We only have 16 bit slice ids
             assert(n_slices <= 0xffff);
-            n_slices = txslice::num_slices_for(varint_len(n_slices)
-                                               + btx.length());
+            n_slices = txslice::num_slices_for(varint_len(n_slices) + len);
     }
-            
-    std::vector<txslice> vec(n_slices);
-    slice_state s = { 0, 0, vec };
+    return n_slices;
+}
+
+// Append the slices for a len-byte tx to *out, with the slice count
+// at the front: the tx itself goes in after that.
+static slice_state start_slices(size_t len, const txid48 &id,
+                                std::vector<txslice> *out)
+{
+    varint_t n_slices = slices_for_tx(len);
+    size_t start = out->size();
+    out->resize(start + n_slices);
+    std::vector<txslice> &vec = *out;
+    slice_state s = { start, 0, vec };
 
     // We 0 pad the end.
-    memset(vec[n_slices-1].contents, 0, sizeof(vec[n_slices-1].contents));
-    for (size_t i = 0; i < vec.size(); ++i) {
-        vec[i].txidbits = id.get_id();
-        assert(vec[i].txidbits == id.get_id());
-        vec[i].fragid = i + id.frag_base();
+    memset(vec.back().contents, 0, sizeof(vec.back().contents));
+    // frag_base() is a SHA256, so just once.
+    u16 base = id.frag_base();
+    for (size_t i = 0; i < n_slices; ++i) {
+        vec[start + i].txidbits = id.get_id();
+        assert(vec[start + i].txidbits == id.get_id());
+        vec[start + i].fragid = i + base;
     }
 
-    // Now linearize into it.
     add_varint(n_slices, add_slice, &s);
+    return s;
+}
+
+void slice_tx(const bitcoin_tx &btx, const txid48 &id, std::vector<txslice> *out)
+{
+    slice_state s = start_slices(btx.length(), id, out);
+
+    // Now linearize into it.
     btx.add_tx(add_slice, &s);
-    assert(s.index == vec.size() - 1 || (s.index == vec.size() && s.off == 0));
+    assert(s.index == out->size() - 1 || (s.index == out->size() && s.off == 0));
+}
+
+std::vector<txslice> slice_tx(const bitcoin_tx &btx, const txid48 &id)
+{
+    std::vector<txslice> vec;
+
+    slice_tx(btx, id, &vec);
+    return vec;
+}
+
+void slice_tx(const tx &t, const txid48 &id, std::vector<txslice> *out)
+{
+    slice_iter it(t, id);
+    size_t start = out->size();
+
+    out->resize(start + it.num_slices());
+    for (size_t i = start; i < out->size(); i++)
+        it.next((*out)[i]);
+}
+
+std::vector<txslice> slice_tx(const tx &t, const txid48 &id)
+{
+    std::vector<txslice> vec;
 
+    slice_tx(t, id, &vec);
     return vec;
 }
 
+struct hdr_state {
+    u8 *buf;
+    size_t len;
+};
+
+static void add_hdr(const void *data, size_t len, void *phdr)
+{
+    hdr_state *h = (hdr_state *)phdr;
+
+    memcpy(h->buf + h->len, data, len);
+    h->len += len;
+}
+
+slice_iter::slice_iter(const tx &t, const txid48 &id)
+    : raw(t.raw.data()), len(t.raw.size()), txidbits(id.get_id()),
+      // frag_base() is a SHA256, so just once.
+      base(id.frag_base()), index(0), num(slices_for_tx(len))
+{
+    hdr_state h = { hdr, 0 };
+
+    add_varint(num, add_hdr, &h);
+    hdrlen = h.len;
+}
+
+// Slice i is bytes i * IBLT_SIZE on of the count then the tx, 0 padded.
+bool slice_iter::next(txslice &s)
+{
+    size_t pos = index * IBLT_SIZE, filled = 0, m;
+
+    if (index == num)
+        return false;
+
+    s.txidbits = txidbits;
+    s.fragid = base + index;
+    if (pos < hdrlen) {
+        m = std::min(hdrlen - pos, (size_t)IBLT_SIZE);
+        memcpy(s.contents, hdr + pos, m);
+        filled = m;
+        pos += m;
+    }
+    if (pos - hdrlen < len) {
+        m = std::min(len - (pos - hdrlen), IBLT_SIZE - filled);
+        memcpy(s.contents + filled, raw + pos - hdrlen, m);
+        filled += m;
+    }
+    memset(s.contents + filled, 0, IBLT_SIZE - filled);
+    index++;
+    return true;
+}
+
 varint_t txslice::slices_expected() const
 {
     const u8 *p = contents;
@@ -91,22 +179,205 @@ varint_t txslice::slices_expected() const
     return pull_varint(&p, &len);
 }
 
-bool rebuild_tx(const std::vector<txslice> &slices, bitcoin_tx &btx)
+// Reads the slices' contents as one stream: the reverse of add_slice().
+struct slice_reader {
+    const txslice *s;
+    size_t off;
+};
+
+static bool pull_slice(void *copy, size_t n, void *preader)
+{
+    slice_reader *r = (slice_reader *)preader;
+    u8 *p = (u8 *)copy;
+
+    while (n) {
+        size_t len = std::min(n, sizeof(r->s->contents) - r->off);
+        memcpy(p, r->s->contents + r->off, len);
+        p += len;
+        n -= len;
+        r->off += len;
+        if (r->off == sizeof(r->s->contents)) {
+            r->s++;
+            r->off = 0;
+        }
+    }
+    return true;
+}
+
+bool rebuild_tx(const std::vector<txslice> &slices, u64 seed, bitcoin_tx &btx)
+{
+    if (slices.empty())
+        return false;
+
+    // The slice count header always fits in the first slice.
+    varint_t num = slices[0].slices_expected();
+    if (num != slices.size())
+        return false;
+
+    slice_reader r = { slices.data(), varint_len(num) };
+    if (!btx.pull_tx(pull_slice, &r,
+                     sizeof(slices[0].contents) * slices.size() - r.off))
+        return false;
+
+    // Garbage which happens to parse won't have the right txid.
+    return txid48(seed, btx.txid()) == slices[0].get_txid48();
+}
+
+void tx_assembler::reset(u64 seed_, const emit_fn &emitfn)
+{
+    seed = seed_;
+    emit = emitfn;
+    num = 0;
+    incomplete = 0;
+    saving = false;
+    changes.clear();
+    std::fill(index.begin(), index.end(), 0);
+}
+
+tx_assembler::partial *tx_assembler::find(u64 id, bool create)
+{
+    // Keep it at most half full, so probes stay short.
+    if (create && (num + 1) * 2 > index.size()) {
+        index.assign(std::max(index.size() * 2, (size_t)64), 0);
+        for (size_t i = 0; i < num; i++) {
+            size_t h = (partials[i].id * 0x9E3779B97F4A7C15ULL) >> 32;
+            while (index[h & (index.size() - 1)])
+                h++;
+            index[h & (index.size() - 1)] = i + 1;
+        }
+    }
+    if (index.empty())
+        return NULL;
+
+    size_t h = (id * 0x9E3779B97F4A7C15ULL) >> 32;
+    for (;; h++) {
+        u32 &slot = index[h & (index.size() - 1)];
+        if (slot && partials[slot - 1].id == id)
+            return &partials[slot - 1];
+        if (!slot)
+            break;
+    }
+    if (!create)
+        return NULL;
+
+    // Reuse a slot from an earlier block if we can: clear() keeps the
+    // vectors' storage.
+    if (num == partials.size())
+        partials.push_back(partial());
+    partial &p = partials[num];
+    p.id = id;
+    p.expected = 0;
+    p.have = 0;
+    p.done = p.emitted = false;
+    p.slices.clear();
+    p.present.clear();
+    index[h & (index.size() - 1)] = ++num;
+    return &p;
+}
+
+void tx_assembler::log(size_t slot, change what, u16 off)
 {
-    u8 contents[sizeof(slices[0].contents) * slices.size()];
-    size_t i;
+    if (saving) {
+        logged l = { slot, what, off };
+        changes.push_back(l);
+    }
+}
+
+bool tx_assembler::add(const txslice &s)
+{
+    txid48 id = s.get_txid48();
+    u16 off = s.fragid - id.frag_base();
+    partial *p = find(id.get_id(), false);
 
-    for (i = 0; i < slices.size(); i++)
-        memcpy(contents + sizeof(slices[i].contents) * i, slices[i].contents,
-               sizeof(slices[i].contents));
-    try {
-        const u8 *cursor = contents;
-        size_t len = sizeof(contents);
-        if (pull_varint(&cursor, &len) != slices[0].slices_expected())
+    // It's a repeat, or tacked on the end of a whole tx.
+    if (p && p->done)
+        return false;
+
+    // Before we know how many to expect, a bogus fragid mustn't make
+    // us allocate room for a tx bigger than a block.
+    if (off >= MAX_TX_SLICES)
+        return false;
+
+    if (!p)
+        p = find(id.get_id(), true);
+    size_t slot = p - partials.data();
+    if (off == 0) {
+        if (p->expected)
+            return false;
+        p->expected = s.slices_expected();
+        log(slot, SET_EXPECTED, off);
+        if (!p->expected || p->expected > MAX_TX_SLICES)
             return false;
-        btx = bitcoin_tx(&cursor, &len);
-    } catch (std::runtime_error &e) {
+        // Anything we already have past the end?
+        for (size_t i = p->expected; i < p->present.size(); i++) {
+            if (p->present[i])
+                return false;
+        }
+    } else if (p->expected && off >= p->expected)
+        return false;
+
+    if (off >= p->slices.size()) {
+        p->slices.resize(off + 1);
+        p->present.resize(off + 1);
+    }
+    if (p->present[off])
+        return false;
+    p->slices[off] = s;
+    p->present[off] = true;
+    if (p->have++ == 0)
+        incomplete++;
+    log(slot, SET_PRESENT, off);
+
+    if (p->have != p->expected)
+        return true;
+
+    // All there: anything past the end would have failed above.
+    p->slices.resize(p->expected);
+    p->present.resize(p->expected);
+    bitcoin_tx btx;
+    if (!rebuild_tx(p->slices, seed, btx)) {
+        btx.release();
         return false;
     }
+
+    p->done = true;
+    incomplete--;
+    log(slot, SET_DONE, off);
+    if (!p->emitted) {
+        p->emitted = true;
+        emit(id, btx);
+    }
+    btx.release();
     return true;
 }
+
+void tx_assembler::checkpoint()
+{
+    saving = true;
+    changes.clear();
+}
+
+void tx_assembler::rollback()
+{
+    // Undo, newest first.  Slots we added stay, empty, so we still know
+    // what we emitted.
+    for (size_t i = changes.size(); i-- > 0; ) {
+        partial &p = partials[changes[i].slot];
+        switch (changes[i].what) {
+        case SET_EXPECTED:
+            p.expected = 0;
+            break;
+        case SET_PRESENT:
+            p.present[changes[i].off] = false;
+            if (--p.have == 0)
+                incomplete--;
+            break;
+        case SET_DONE:
+            p.done = false;
+            incomplete++;
+            break;
+        }
+    }
+    saving = false;
+    changes.clear();
+}
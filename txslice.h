@@ -5,9 +5,11 @@ extern "C" {
 };
 #include <vector>
 #include <cstring>
+#include <functional>
 #include "txid48.h"
 
 struct bitcoin_tx;
+struct tx;
 
 // An individual bucket: Must be plain old data!
 struct txslice {
@@ -37,7 +39,108 @@ struct txslice {
 	varint_t slices_expected() const;
 };
 
+// No tx has more slices than a whole (1MB) block.
+static const size_t MAX_TX_SLICES = (1000000 + IBLT_SIZE - 1) / IBLT_SIZE;
+
 std::vector<txslice> slice_tx(const bitcoin_tx &btx, const txid48 &id);
-bool rebuild_tx(const std::vector<txslice> &slices, bitcoin_tx &btx);
+// Same, but append them to *out (which keeps its capacity for next time).
+void slice_tx(const bitcoin_tx &btx, const txid48 &id, std::vector<txslice> *out);
+// Both, straight from the bytes t keeps, rather than re-serializing.
+std::vector<txslice> slice_tx(const tx &t, const txid48 &id);
+void slice_tx(const tx &t, const txid48 &id, std::vector<txslice> *out);
+
+// The same slices as slice_tx(), one at a time, so nothing needs to
+// hold them all.  t must outlive it.
+class slice_iter {
+public:
+	// No slices.
+	slice_iter() : raw(NULL), len(0), hdrlen(0), txidbits(0), base(0),
+				   index(0), num(0) { }
+	slice_iter(const tx &t, const txid48 &id);
+
+	// Fill in the next slice: false once they're all done.
+	bool next(txslice &s);
+
+	size_t num_slices() const { return num; }
+
+private:
+	const u8 *raw;
+	size_t len;
+	// Slice count goes in front of the tx, as a varint.
+	u8 hdr[9];
+	size_t hdrlen;
+	u64 txidbits;
+	u16 base;
+	size_t index, num;
+};
+// Parses the tx straight out of the slices (no copy, no exceptions): false
+// if it doesn't parse, or isn't the tx their txid48 (under seed) says.
+bool rebuild_tx(const std::vector<txslice> &slices, u64 seed, bitcoin_tx &btx);
+
+// Groups their slices by txid48 as they're peeled, and hands each tx to
+// emit as soon as its last slice arrives, rather than waiting for the
+// whole block.
+class tx_assembler {
+public:
+	typedef std::function<void(const txid48 &, const bitcoin_tx &)> emit_fn;
+
+	tx_assembler() : seed(0), num(0), incomplete(0), saving(false) { }
+	// seed is the iblt's, to check each tx against its txid48.
+	tx_assembler(u64 seed, const emit_fn &emitfn)
+		: seed(seed), emit(emitfn), num(0), incomplete(0), saving(false) { }
+
+	// Start again, for another block or peer.  Keeps what we've
+	// allocated, so once we've seen a block this size it needn't.
+	void reset(u64 seed, const emit_fn &emitfn);
+
+	// False if s can't be part of a good tx: we already have it, it's
+	// past the end of its tx (or of any tx), or the tx won't rebuild.
+	bool add(const txslice &s);
+
+	// Have we got all of every tx we've seen a slice of?
+	bool complete() const { return incomplete == 0; }
+
+	// Remember where we are, so rollback() can go back there, but
+	// never emit the same tx twice.
+	void checkpoint();
+	void rollback();
+
+private:
+	struct partial {
+		u64 id;
+		// 0 until we get the first slice.
+		varint_t expected;
+		size_t have;
+		bool done, emitted;
+		// Indexed by offset from frag_base().
+		std::vector<txslice> slices;
+		std::vector<bool> present;
+	};
+
+	// What add() changed, for rollback().
+	enum change { SET_EXPECTED, SET_PRESENT, SET_DONE };
+	struct logged {
+		size_t slot;
+		change what;
+		u16 off;
+	};
+
+	// Find id's slot (NULL if none, and !create).
+	partial *find(u64 id, bool create);
+	void log(size_t slot, change what, u16 off);
+
+	u64 seed;
+	emit_fn emit;
+	// Slots [0, num) are this block's txs; the rest are kept for later.
+	std::vector<partial> partials;
+	size_t num;
+	// Open addressing on id: slot + 1, or 0.  At most half full.
+	std::vector<u32> index;
+	// Slots with slices, but not done.
+	size_t incomplete;
+	// Since checkpoint().
+	bool saving;
+	std::vector<logged> changes;
+};
 
 #endif // TXSLICE_H
@@ -18,24 +18,33 @@
 */
 static bool use_subtables = false;
 
+/* Subtables reduce by multiply-shift, like raw_iblt::SUBTABLES. */
+static unsigned int fastrange(u32 h, unsigned n)
+{
+	return ((u64)h * n) >> 32;
+}
+
 static unsigned int hash_pos(unsigned val, unsigned buckets,
 			     unsigned round, unsigned iter)
 {
 	unsigned subsize = buckets / 3;
 
-	/* Ignore subsize for pathological buckets < 3 case */
-	if (!use_subtables || subsize == 0)
+	if (!use_subtables)
 		return hash_u32(&val, 1, iter+round) % buckets;
 
+	/* Ignore subsize for pathological buckets < 3 case */
+	if (subsize == 0)
+		return fastrange(hash_u32(&val, 1, iter+round), buckets);
+
 	/* Apply any integer rounding to last subtable. */
 	switch (iter) {
 	case 0:
-		return hash_u32(&val, 1, iter+round) % subsize;
+		return fastrange(hash_u32(&val, 1, iter+round), subsize);
 	case 1:
-		return subsize + hash_u32(&val, 1, iter+round) % subsize;
+		return subsize + fastrange(hash_u32(&val, 1, iter+round), subsize);
 	case 2: {
 		unsigned int remainder = buckets - subsize * 2;
-		return subsize * 2 + hash_u32(&val, 1, iter+round) % remainder;
+		return subsize * 2 + fastrange(hash_u32(&val, 1, iter+round), remainder);
 	}
 	}
 	/* We only have 3 rounds */
@@ -112,7 +121,7 @@ int main(int argc, char *argv[])
 {
 	unsigned elements, *arr, *counts;
 	bool verbose = false, found = false, naive = false;
-	unsigned min, max;
+	unsigned min, max, runs = NUM_RUNS;
 
 	err_set_progname(argv[0]);
 	opt_register_noarg("-v|--verbose", opt_set_bool, &verbose,
@@ -121,6 +130,8 @@ int main(int argc, char *argv[])
 			   "Don't use binary search, but simple increment");
 	opt_register_noarg("--sub-tables", opt_set_bool, &use_subtables,
 			   "Use subtables to ensure distinct hashes");
+	opt_register_arg("--runs", opt_set_uintval, opt_show_uintval, &runs,
+			 "Number of trials for each bucket count");
 	opt_parse(&argc, argv, opt_log_stderr_exit);
 	
 	if (argc != 2 || (elements = atoi(argv[1])) == 0)
@@ -146,20 +157,20 @@ int main(int argc, char *argv[])
 		else
 			buckets = (min + max) / 2;
 
-		for (i = 0; i < NUM_RUNS; i++)
+		for (i = 0; i < runs; i++)
 			successes += add_and_extract(arr, counts, buckets,
 						     elements, i);
 		if (verbose)
 			printf("%u: %5g%%\n",
-			       buckets, successes * 100.0 / NUM_RUNS);
+			       buckets, successes * 100.0 / runs);
 		if (naive) {
-			if (successes >= NUM_RUNS * 95 / 100) {
+			if (successes >= runs * 95 / 100) {
 				found = true;
 				break;
 			}
 			min++;
 		} else {
-			if (successes >= NUM_RUNS * 95 / 100) {
+			if (successes >= runs * 95 / 100) {
 				max = buckets;
 				found = true;
 			} else {
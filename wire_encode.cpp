@@ -1,6 +1,7 @@
 #include "wire_encode.h"
 #include "bitcoin_tx.h"
 #include <cassert>
+#include <climits>
 
 void add_linearize(const void *data, size_t len, void *pvec)
 {
@@ -132,3 +133,28 @@ bool decode_bitset(const u8 **p, size_t *len, txbitsSet &bset)
 
     return *p != NULL;
 }
+
+void add_iblt_size(std::vector<u8> *arr, size_t size, unsigned int flags)
+{
+    if (flags) {
+        add_varint(0, add_linearize, arr);
+        add_varint(flags, add_linearize, arr);
+    }
+    add_varint(size, add_linearize, arr);
+}
+
+bool pull_iblt_size(const u8 **p, size_t *len, size_t *size, unsigned int *flags)
+{
+    *flags = 0;
+    *size = pull_varint(p, len);
+    if (*size == 0) {
+        varint_t f = pull_varint(p, len);
+        *size = pull_varint(p, len);
+        // Flags must be non-zero, or it's not the new encoding, and
+        // mustn't lose bits to fit.
+        if (!f || f > UINT_MAX)
+            return false;
+        *flags = f;
+    }
+    return *p != NULL && *size != 0;
+}
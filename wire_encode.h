@@ -3,6 +3,7 @@
 extern "C" {
 #include <ccan/short_types/short_types.h>
 }
+#include <cstddef>
 #include <vector>
 #include <array>
 #include <unordered_set>
@@ -18,4 +19,10 @@ void add_linearize(const void *data, size_t len, void *pvec);
 
 void add_bitset(std::vector<u8> *arr, const txbitsSet &bset);
 bool decode_bitset(const u8 **p, size_t *len, txbitsSet &bset);
+
+// IBLT size, with its flags (see raw_iblt).  No flags is just the size;
+// otherwise it's a 0, the flags, then the size: older decoders see a
+// zero-sized IBLT and reject it.
+void add_iblt_size(std::vector<u8> *arr, size_t size, unsigned int flags);
+bool pull_iblt_size(const u8 **p, size_t *len, size_t *size, unsigned int *flags);
 #endif // WIRE_ENCODE_H
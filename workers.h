@@ -0,0 +1,86 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+// A few threads kept waiting for work, so a parallel step needn't start
+// (and join) its own each time.
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class worker_pool {
+public:
+    worker_pool() : call(NULL), arg(NULL), num(0), busy(0), gen(0), quit(false) { }
+    worker_pool(const worker_pool &) = delete;
+    worker_pool &operator=(const worker_pool &) = delete;
+
+    ~worker_pool() {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            quit = true;
+        }
+        wake.notify_all();
+        for (auto &t: threads)
+            t.join();
+    }
+
+    // Call fn(i) for each i in [0, n), and return once they're all done:
+    // 0 runs on this thread, the rest on workers (started the first time
+    // that many are needed, then kept).  One run() at a time: others wait.
+    template <typename F>
+    void run(unsigned int n, const F &fn) {
+        if (n <= 1) {
+            if (n)
+                fn(0);
+            return;
+        }
+
+        std::lock_guard<std::mutex> one_at_a_time(running);
+        std::unique_lock<std::mutex> lock(m);
+        while (threads.size() < n - 1)
+            threads.push_back(std::thread(&worker_pool::work, this,
+                                          threads.size() + 1, gen));
+        call = [](const void *f, unsigned int i) { (*(const F *)f)(i); };
+        arg = &fn;
+        num = n;
+        busy = n - 1;
+        gen++;
+        lock.unlock();
+        wake.notify_all();
+
+        fn(0);
+
+        lock.lock();
+        finished.wait(lock, [this]() { return busy == 0; });
+    }
+
+private:
+    void work(unsigned int i, unsigned long seen) {
+        std::unique_lock<std::mutex> lock(m);
+
+        for (;;) {
+            wake.wait(lock, [&]() { return quit || gen != seen; });
+            if (quit)
+                return;
+            seen = gen;
+            if (i >= num)
+                continue;
+            lock.unlock();
+            call(arg, i);
+            lock.lock();
+            if (--busy == 0)
+                finished.notify_one();
+        }
+    }
+
+    std::mutex running, m;
+    std::condition_variable wake, finished;
+    std::vector<std::thread> threads;
+    // The current run(): fn is arg, called through call.
+    void (*call)(const void *, unsigned int);
+    const void *arg;
+    unsigned int num, busy;
+    // Bumped for each run(), so a worker knows there's something new.
+    unsigned long gen;
+    bool quit;
+};
+#endif // WORKERS_H
@@ -0,0 +1,230 @@
+#include "xorbytes.h"
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+// Everyone finishes off with this: 8 bytes at a time, then the dregs.
+static void xor_scalar(u8 *dst, const u8 *src, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        u64 a, b;
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a ^= b;
+        memcpy(dst + i, &a, 8);
+    }
+    for (; i < len; i++)
+        dst[i] ^= src[i];
+}
+
+static bool zero_scalar(const u8 *p, size_t len)
+{
+    size_t i;
+    u64 acc = 0;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        u64 a;
+        memcpy(&a, p + i, 8);
+        acc |= a;
+    }
+    for (; i < len; i++)
+        acc |= p[i];
+    return acc == 0;
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+static void xor_sse2(u8 *dst, const u8 *src, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(a, b));
+    }
+    xor_scalar(dst + i, src + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static bool zero_sse2(const u8 *p, size_t len)
+{
+    size_t i;
+    __m128i acc = _mm_setzero_si128();
+
+    for (i = 0; i + 16 <= len; i += 16)
+        acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(p + i)));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF)
+        return false;
+    return zero_scalar(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void xor_avx2(u8 *dst, const u8 *src, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(a, b));
+    }
+    xor_sse2(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static bool zero_avx2(const u8 *p, size_t len)
+{
+    size_t i;
+    __m256i acc = _mm256_setzero_si256();
+
+    for (i = 0; i + 32 <= len; i += 32)
+        acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i *)(p + i)));
+    if (!_mm256_testz_si256(acc, acc))
+        return false;
+    return zero_sse2(p + i, len - i);
+}
+
+__attribute__((target("avx512f")))
+static void xor_avx512(u8 *dst, const u8 *src, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 64 <= len; i += 64) {
+        __m512i a = _mm512_loadu_si512((const void *)(dst + i));
+        __m512i b = _mm512_loadu_si512((const void *)(src + i));
+        _mm512_storeu_si512((void *)(dst + i), _mm512_xor_si512(a, b));
+    }
+    xor_avx2(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx512f")))
+static bool zero_avx512(const u8 *p, size_t len)
+{
+    size_t i;
+    __m512i acc = _mm512_setzero_si512();
+
+    for (i = 0; i + 64 <= len; i += 64)
+        acc = _mm512_or_si512(acc, _mm512_loadu_si512((const void *)(p + i)));
+    if (_mm512_test_epi64_mask(acc, acc))
+        return false;
+    return zero_avx2(p + i, len - i);
+}
+#endif // HAVE_X86_KERNELS
+
+#ifdef HAVE_X86_KERNELS
+static bool have_avx512()
+{
+    return __builtin_cpu_supports("avx512f");
+}
+
+static bool have_avx2()
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+static bool have_sse2()
+{
+    return __builtin_cpu_supports("sse2");
+}
+#endif
+
+struct xor_kernels {
+    const char *name;
+    void (*xor_fn)(u8 *, const u8 *, size_t);
+    bool (*zero_fn)(const u8 *, size_t);
+    // NULL if any CPU runs it.
+    bool (*usable)();
+};
+
+// Best first.
+static const xor_kernels all_kernels[] = {
+#ifdef HAVE_X86_KERNELS
+    { "avx512", xor_avx512, zero_avx512, have_avx512 },
+    { "avx2", xor_avx2, zero_avx2, have_avx2 },
+    { "sse2", xor_sse2, zero_sse2, have_sse2 },
+#endif
+    { "scalar", xor_scalar, zero_scalar, NULL }
+};
+
+static xor_kernels pick_kernels()
+{
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+#endif
+    for (const auto &k: all_kernels) {
+        if (!k.usable || k.usable())
+            return k;
+    }
+    return all_kernels[0];
+}
+
+static const xor_kernels &kernels()
+{
+    static const xor_kernels k = pick_kernels();
+    return k;
+}
+
+void xor_bytes(u8 *dst, const u8 *src, size_t len)
+{
+    kernels().xor_fn(dst, src, len);
+}
+
+bool bytes_zero(const u8 *p, size_t len)
+{
+    return kernels().zero_fn(p, len);
+}
+
+const char *xor_bytes_impl()
+{
+    return kernels().name;
+}
+
+const char *xor_bytes_selftest(size_t len)
+{
+    // Room to start anywhere in a 64-byte line.
+    const size_t ALIGN = 64;
+    std::vector<u8> src(len + ALIGN), dst(len + ALIGN), want(len + ALIGN),
+        zeroes(len + ALIGN);
+
+    for (size_t i = 0; i < src.size(); i++) {
+        src[i] = i * 7 + 1;
+        want[i] = i * 13 + 5;
+    }
+
+    // Makes sure the CPU's been looked at.
+    kernels();
+    for (const auto &k: all_kernels) {
+        if (k.usable && !k.usable())
+            continue;
+        for (size_t l = 0; l <= len; l++) {
+            for (size_t a = 0; a < ALIGN; a++) {
+                // src at a different alignment to dst, mostly.
+                size_t sa = (a * 13 + 5) % ALIGN;
+                dst = want;
+                k.xor_fn(dst.data() + a, src.data() + sa, l);
+                xor_scalar(want.data() + a, src.data() + sa, l);
+                // Including not touching anything either side.
+                if (dst != want)
+                    return k.name;
+
+                if (!k.zero_fn(zeroes.data() + a, l))
+                    return k.name;
+                for (size_t i = 0; i < l; i++) {
+                    zeroes[a + i] = 0x80 >> (i % 8);
+                    bool zero = k.zero_fn(zeroes.data() + a, l);
+                    zeroes[a + i] = 0;
+                    if (zero)
+                        return k.name;
+                }
+            }
+        }
+    }
+    return NULL;
+}
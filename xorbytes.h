@@ -0,0 +1,22 @@
+#ifndef XORBYTES_H
+#define XORBYTES_H
+// Bulk byte kernels for IBLT buckets, picked at runtime by CPU features.
+extern "C" {
+#include <ccan/short_types/short_types.h>
+};
+#include <cstddef>
+
+// dst[i] ^= src[i] for i < len.  Same bytes whatever the CPU.
+void xor_bytes(u8 *dst, const u8 *src, size_t len);
+
+// Are all len bytes zero?
+bool bytes_zero(const u8 *p, size_t len);
+
+// Name of the kernel we're using ("avx512", "avx2", "sse2" or "scalar").
+const char *xor_bytes_impl();
+
+// Every kernel this CPU runs, against the scalar one for each length up
+// to len, at every alignment in a cache line: NULL if they all agree,
+// otherwise the name of the first which doesn't.
+const char *xor_bytes_selftest(size_t len);
+#endif // XORBYTES_H